@@ -13,105 +13,9 @@
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/backing-dev.h>
+#include <linux/vmalloc.h>
 #include "prlfs.h"
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-inline struct radix_tree_root *prlfs_page_cache_get_locked(
-		struct address_space *mapping)
-{
-	xa_lock(&mapping->i_pages);
-	return &mapping->i_pages;
-}
-inline void prlfs_page_cache_unlock(struct address_space *mapping)
-{
-	xa_unlock(&mapping->i_pages);
-}
-#else
-inline struct radix_tree_root *prlfs_page_cache_get_locked(
-		struct address_space *mapping)
-{
-	spin_lock(&mapping->tree_lock);
-	return &mapping->page_tree;
-}
-inline void prlfs_page_cache_unlock(struct address_space *mapping)
-{
-	spin_unlock(&mapping->tree_lock);
-}
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0) || \
-			   defined(PRLFS_RHEL_8_1_GE)
-#define prlfs_page_cache_invalid_entry(x) xa_is_value(x)
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0) || \
-                            defined(PRLFS_RHEL_6_2_GE)
-#define prlfs_page_cache_invalid_entry(x) radix_tree_exceptional_entry(x)
-#else
-#define prlfs_page_cache_invalid_entry(x) 0
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-static int prlfs_mapping_update(struct file *filp)
-{
-	struct address_space *mapping = filp->f_mapping;
-	struct radix_tree_iter iter;
-	void **slot;
-	struct radix_tree_root *pages;
-
-	pages = prlfs_page_cache_get_locked(mapping);
-	radix_tree_for_each_slot(slot, pages, &iter, 0) {
-		struct page *cur_page = radix_tree_deref_slot(slot);
-		if (!cur_page) {
-			DPRINTK("NULL page in mapping tree\n");
-			continue;
-		}
-		if (prlfs_page_cache_invalid_entry(cur_page))
-			continue;
-		ClearPageUptodate(cur_page);
-	}
-	prlfs_page_cache_unlock(mapping);
-	return 0;
-}
-
-#else
-static int prlfs_mapping_update(struct file *filp)
-{
-	struct inode *inode = FILE_DENTRY(filp)->d_inode;
-	struct address_space *mapping = filp->f_mapping;
-	struct radix_tree_root *pages;
-	unsigned int i, found_pages = 0;
-	unsigned int max_pages = (inode->i_size / PAGE_SIZE) + 1;
-	void ***slots = kzalloc(max_pages * sizeof(void**), GFP_KERNEL);
-	if (!slots)
-		return -ENOMEM;
-
-	pages = prlfs_page_cache_get_locked(mapping);
-	found_pages = radix_tree_gang_lookup_slot(pages,
-// Add RADIX_TREE_EXCEPTIONAL_ENTRY condition as a criteria of
-// using expanded version of radix_tree_gang_lookup_slot() in SLES 11.
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0) || \
-	defined(PRLFS_RHEL_6_2_GE) || \
-	defined(RADIX_TREE_EXCEPTIONAL_ENTRY)
-				slots, NULL, 0, max_pages);
-#else
-				slots, 0, max_pages);
-#endif
-
-	for (i = 0; i < found_pages; i++) {
-		struct page *cur_page = radix_tree_deref_slot(slots[i]);
-		if (!cur_page) {
-			DPRINTK("NULL page in mapping tree\n");
-			continue;
-		}
-		if (prlfs_page_cache_invalid_entry(cur_page))
-			continue;
-		ClearPageUptodate(cur_page);
-	}
-	prlfs_page_cache_unlock(mapping);
-	kfree(slots);
-	return 0;
-}
-#endif
-
 static int prlfs_check_open_flags(const struct file *filp, const struct prlfs_fd *pfd)
 {
 	if (pfd->f_flags == O_RDWR)
@@ -130,8 +34,11 @@ static int prlfs_open(struct inode *inode, struct file *filp)
 	struct dentry *dentry = FILE_DENTRY(filp);
 	struct prlfs_file_info pfi;
 	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_attr_req *ar = NULL;
+	struct prlfs_attr *attr;
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(open);
 	if (IS_ERR(pfd)) {
 		ret = PTR_ERR(pfd);
 		goto out_nolock;
@@ -152,18 +59,27 @@ static int prlfs_open(struct inode *inode, struct file *filp)
 
 	//Get file path
 	buflen = PATH_MAX;
-	buf = kmalloc(buflen, GFP_KERNEL);
+	buf = prlfs_path_alloc();
 	if (buf == NULL) {
 		ret = -ENOMEM;
 		goto out;
 	}
-	memset(buf, 0, buflen);
 	p = prlfs_get_path(dentry, buf, &buflen);
 	if (IS_ERR(p)) {
 		ret = PTR_ERR(p);
 		goto out_free_buf;
 	}
 
+	/* the data cache attributes are fetched while the host opens the file */
+	if (S_ISREG(inode->i_mode)) {
+		ar = kmalloc(sizeof(*ar) + buflen, GFP_KERNEL);
+		if (ar) {
+			memcpy(ar->path, p, buflen);
+			ar->psize = buflen;
+			host_request_attr_start(sb, ar);
+		}
+	}
+
 	// Here we set full access to file for first open try.
 	open_flags = (filp->f_flags | O_RDWR) & ~O_WRONLY;
 	// We send file read/write offset to host, so we don't
@@ -198,11 +114,20 @@ retry:
 	pfd->f_counter = 1;
 	pfd->f_flags = open_flags & O_ACCMODE;
 	dentry->d_time = 0;
-	ret = prlfs_mapping_update(filp);
-	if (ret < 0)
-		DPRINTK("prlfs_mapping_update return error %d\n", ret);
+	if (S_ISREG(inode->i_mode)) {
+		attr = (ar && !host_request_attr_wait(ar)) ? &ar->attr : NULL;
+		ret = prlfs_revalidate_data(dentry, attr);
+		if (ret < 0) {
+			DPRINTK("prlfs_revalidate_data return error %d\n", ret);
+			ret = 0;
+		}
+	}
 out_free_buf:
-	kfree(buf);
+	if (ar) {
+		call_tg_async_wait(ar->pending);
+		kfree(ar);
+	}
+	prlfs_path_free(buf);
 out:
 	prlfs_inode_unlock(inode);
 out_nolock:
@@ -212,7 +137,130 @@ out_nolock:
 
 static int writeback_inode(struct inode *inode)
 {
-	return filemap_fdatawrite(inode->i_mapping);
+	return filemap_write_and_wait(inode->i_mapping);
+}
+
+static int prlfs_flush(struct file *filp, fl_owner_t id)
+{
+	if (!(filp->f_mode & FMODE_WRITE))
+		return 0;
+	return writeback_inode(FILE_DENTRY(filp)->d_inode);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+static int prlfs_fsync(struct file *filp, loff_t start, loff_t end,
+		       int datasync)
+{
+	PRLFS_OP_INC(fsync);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	return file_write_and_wait_range(filp, start, end);
+#else
+	return filemap_write_and_wait_range(filp->f_mapping, start, end);
+#endif
+}
+#endif
+
+/*
+ * With lazyrelease the last close does not wait for L_RELEASE. Requests of
+ * closed files are collected for PRLFS_RELEASE_DELAY or until a batch is
+ * full and then sent together, so their round trips overlap. Removing and
+ * renaming names flushes the queue first, as hosts may refuse to delete
+ * open files.
+ */
+static void prlfs_release_send(struct prlfs_sb_info *sbi,
+			       struct list_head *list)
+{
+	struct prlfs_release_req *rr, *batch[PRLFS_RELEASE_BATCH];
+	int i, nr, ret, retry;
+
+	while (!list_empty(list)) {
+		nr = 0;
+		while (nr < PRLFS_RELEASE_BATCH && !list_empty(list)) {
+			rr = list_first_entry(list, struct prlfs_release_req,
+					      list);
+			list_del(&rr->list);
+			host_request_release_start(sbi->pdev, rr);
+			batch[nr++] = rr;
+		}
+		for (i = 0; i < nr; i++) {
+			rr = batch[i];
+			retry = 1000;
+			while ((ret = host_request_release_wait(rr)) ==
+			       -ERESTARTSYS && retry-- > 0)
+				host_request_release_start(sbi->pdev, rr);
+			if (ret < 0)
+				printk(KERN_ERR "prlfs_release returns error "
+				       "(%d)\n", ret);
+			kfree(rr);
+			atomic_dec(&sbi->releases);
+		}
+	}
+}
+
+void prlfs_release_flush(struct prlfs_sb_info *sbi)
+{
+	LIST_HEAD(list);
+
+	if (!atomic_read(&sbi->releases))
+		return;
+	/* also waits for a batch sent by the work */
+	mutex_lock(&sbi->release_mutex);
+	spin_lock(&sbi->release_lock);
+	list_splice_init(&sbi->release_queue, &list);
+	spin_unlock(&sbi->release_lock);
+	prlfs_release_send(sbi, &list);
+	mutex_unlock(&sbi->release_mutex);
+}
+
+static void prlfs_release_work(struct work_struct *work)
+{
+	struct prlfs_sb_info *sbi = container_of(to_delayed_work(work),
+					struct prlfs_sb_info, release_work);
+
+	prlfs_release_flush(sbi);
+}
+
+/* returns nonzero if the caller has to release the handle itself */
+static int prlfs_release_queue(struct prlfs_sb_info *sbi,
+			       struct prlfs_file_info *pfi)
+{
+	struct prlfs_release_req *rr;
+	unsigned long delay = PRLFS_RELEASE_DELAY;
+
+	if (!sbi->lazyrelease)
+		return 1;
+	rr = kmalloc(sizeof(*rr), GFP_KERNEL);
+	if (!rr)
+		return 1;
+	prlfs_file_info_to_desc(&rr->pfd, pfi);
+
+	spin_lock(&sbi->release_lock);
+	list_add_tail(&rr->list, &sbi->release_queue);
+	if (atomic_inc_return(&sbi->releases) >= PRLFS_RELEASE_BATCH)
+		delay = 0;
+	spin_unlock(&sbi->release_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+	if (!delay)
+		mod_delayed_work(system_wq, &sbi->release_work, 0);
+	else
+#endif
+		schedule_delayed_work(&sbi->release_work, delay);
+	return 0;
+}
+
+void prlfs_release_init(struct prlfs_sb_info *sbi)
+{
+	spin_lock_init(&sbi->release_lock);
+	INIT_LIST_HEAD(&sbi->release_queue);
+	atomic_set(&sbi->releases, 0);
+	mutex_init(&sbi->release_mutex);
+	INIT_DELAYED_WORK(&sbi->release_work, prlfs_release_work);
+}
+
+void prlfs_release_destroy(struct prlfs_sb_info *sbi)
+{
+	cancel_delayed_work_sync(&sbi->release_work);
+	prlfs_release_flush(sbi);
 }
 
 static int prlfs_release(struct inode *inode, struct file *filp)
@@ -223,15 +271,22 @@ static int prlfs_release(struct inode *inode, struct file *filp)
 	int ret = 0;
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(release);
 	writeback_inode(inode);
 
 	prlfs_inode_lock(inode);
 	BUG_ON(!pfd->f_counter);
 	if (pfd->f_counter == 1) {
+		if (pfd->cache_written)
+			prlfs_record_data(FILE_DENTRY(filp));
+		/* the host handle is used by requests still in flight */
+		prlfs_aio_drain(inode);
 		init_pfi(&pfi, inode, 0, 0);
-		ret = host_request_release(sb, &pfi);
+		if (prlfs_release_queue(PRLFS_SB(sb), &pfi))
+			ret = host_request_release(sb, &pfi);
 		if (ret < 0)
 			printk(KERN_ERR "prlfs_release returns error (%d)\n", ret);
+		prlfs_dir_cache_drop(inode);
 	}
 
 	pfd->f_counter--;
@@ -255,7 +310,6 @@ static int prlfs_fill_dir(struct file *filp,
 #endif
 					loff_t *pos, void *buf, int buflen)
 {
-	struct super_block *sb;
 	prlfs_dirent *de;
 	int offset, ret, name_len, rec_len;
 	u64 ino;
@@ -263,8 +317,6 @@ static int prlfs_fill_dir(struct file *filp,
 
 	DPRINTK("ENTER\n");
 	assert(FILE_DENTRY(filp));
-	assert(FILE_DENTRY(filp)->d_sb);
-	sb = FILE_DENTRY(filp)->d_sb;
 	offset = 0;
 	ret = 0;
 
@@ -301,7 +353,14 @@ static int prlfs_fill_dir(struct file *filp,
 			type = PRLFS_FILE_TYPE_UNKNOWN;
 		}
 		type = prlfs_filetype_table[type];
-		ino = iunique(sb, PRLFS_GOOD_INO);
+		/*
+		 * Host replies carry no inode numbers: d_ino matches st_ino
+		 * only for names already looked up, with rdplus all of them.
+		 * Others get a temporary number unrelated to host_inodes.
+		 */
+		ino = prlfs_cached_ino(FILE_DENTRY(filp), de->name, name_len);
+		if (ino == 0)
+			ino = get_next_ino();
 		DPRINTK("filldir: name %s len %d, offset %lld, "
 						"de->type %d -> type %d\n",
 			 de->name, name_len, (*pos), de->file_type, type);
@@ -323,6 +382,147 @@ out:
 	return ret;
 }
 
+/*
+ * Walks at most *nr well-formed entries of a host readdir reply, all of
+ * them if *nr is negative. Returns the offset reached, *nr is set to the
+ * number of entries passed.
+ */
+static int prlfs_dir_walk(void *buf, int buflen, int *nr)
+{
+	prlfs_dirent *de;
+	int offset = 0, i = 0, name_len, rec_len;
+
+	while (*nr < 0 || i < *nr) {
+		de = (prlfs_dirent *)(buf + offset);
+		if (offset + sizeof(prlfs_dirent) > buflen)
+			break;
+		name_len = de->name_len;
+		rec_len = PRLFS_DIR_REC_LEN(name_len);
+		if (name_len == 0 || rec_len + offset > buflen ||
+		    de->name[name_len] != 0)
+			break;
+		offset += rec_len;
+		i++;
+	}
+	*nr = i;
+	return offset;
+}
+
+/* bytes of host replies cached over all directories */
+static atomic_long_t prlfs_dir_cache_bytes = ATOMIC_LONG_INIT(0);
+
+void prlfs_dir_cache_drop(struct inode *inode)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_dir_cache *cache;
+	struct prlfs_dir_chunk *dc, *tmp;
+
+	if (!pfd || IS_ERR(pfd) || !pfd->dir_cache)
+		return;
+	cache = pfd->dir_cache;
+	list_for_each_entry_safe(dc, tmp, &cache->chunks, list) {
+		atomic_long_sub(dc->len, &prlfs_dir_cache_bytes);
+		prlfs_kvfree(dc->buf);
+		kfree(dc);
+	}
+	kfree(cache);
+	pfd->dir_cache = NULL;
+}
+
+/* an expired cache is kept while the host mtime of the directory is older */
+static struct prlfs_dir_chunk *prlfs_dir_cache_find(struct dentry *dentry,
+						     loff_t pos)
+{
+	struct inode *inode = dentry->d_inode;
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_dir_chunk *dc;
+
+	if (IS_ERR(pfd) || !pfd->dir_cache)
+		return NULL;
+	if (jiffies - pfd->dir_cache->stamp >= PRLFS_SB(inode->i_sb)->entry_ttl &&
+	    !prlfs_dir_unchanged_since(dentry, pfd->dir_cache->stamp)) {
+		prlfs_dir_cache_drop(inode);
+		return NULL;
+	}
+	list_for_each_entry(dc, &pfd->dir_cache->chunks, list) {
+		if (pos < dc->pos)
+			continue;
+		if (pos < dc->pos + dc->nr || (dc->eof && pos == dc->pos + dc->nr))
+			return dc;
+	}
+	return NULL;
+}
+
+/*
+ * Keeps a copy of a host reply that continues the cached stream, sized
+ * to the reply. Returns 1 if the reply was cached.
+ */
+static int prlfs_dir_cache_add(struct inode *inode, loff_t pos,
+			       void *buf, int len, int eof)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_dir_cache *cache;
+	struct prlfs_dir_chunk *dc, *last;
+	int nr = -1;
+
+	if (IS_ERR(pfd) || PRLFS_SB(inode->i_sb)->entry_ttl == 0)
+		return 0;
+	prlfs_dir_walk(buf, len, &nr);
+	if (nr == 0 && !eof)
+		return 0;
+
+	cache = pfd->dir_cache;
+	if (cache) {
+		if (cache->nr_chunks >= PRLFS_DIR_CACHE_CHUNKS)
+			return 0;
+		last = list_entry(cache->chunks.prev,
+				  struct prlfs_dir_chunk, list);
+		if (last->eof || pos != last->pos + last->nr)
+			return 0;
+	}
+	if (atomic_long_add_return(len, &prlfs_dir_cache_bytes) >
+	    PRLFS_DIR_CACHE_BYTES)
+		goto out_unaccount;
+	dc = kmalloc(sizeof(*dc), GFP_KERNEL);
+	if (!dc)
+		goto out_unaccount;
+	dc->buf = prlfs_kvmalloc(len);
+	if (!dc->buf)
+		goto out_free;
+	if (!cache) {
+		cache = kmalloc(sizeof(*cache), GFP_KERNEL);
+		if (!cache)
+			goto out_free_buf;
+		INIT_LIST_HEAD(&cache->chunks);
+		cache->nr_chunks = 0;
+		cache->stamp = jiffies;
+		pfd->dir_cache = cache;
+	}
+	dc->pos = pos;
+	dc->nr = nr;
+	dc->len = len;
+	dc->eof = eof;
+	memcpy(dc->buf, buf, len);
+	list_add_tail(&dc->list, &cache->chunks);
+	cache->nr_chunks++;
+	return 1;
+
+out_free_buf:
+	prlfs_kvfree(dc->buf);
+out_free:
+	kfree(dc);
+out_unaccount:
+	atomic_long_sub(len, &prlfs_dir_cache_bytes);
+	return 0;
+}
+
+/*
+ * Host replies are cached per directory inode for entry_ttl while the
+ * directory is open, so restarted getdents, seekdir and other readers of
+ * the same directory do not go to the host again. The last close drops
+ * the cache, all caches together are limited to PRLFS_DIR_CACHE_BYTES.
+ * The directory is locked by the VFS while we are here.
+ */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 static int prlfs_readdir(struct file *filp, struct dir_context *ctx)
 #else
@@ -330,13 +530,15 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 #endif
 {
 	struct prlfs_file_info pfi;
+	struct prlfs_dir_chunk *dc;
 	struct super_block *sb;
 	struct inode *inode;
-	int ret, len, buflen;
+	int ret, len, buflen, off, nr;
 	void *buf;
 	off_t prev_offset;
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(readdir);
 	ret = 0;
 	assert(FILE_DENTRY(filp));
 	inode = FILE_DENTRY(filp)->d_inode;
@@ -349,20 +551,50 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		0);
 	assert(FILE_DENTRY(filp)->d_sb);
 	sb = FILE_DENTRY(filp)->d_sb;
-	buflen = PAGE_SIZE;
-	buf = kmalloc(buflen, GFP_KERNEL);
-	if (buf == NULL) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	buflen = PRLFS_SB(sb)->rdsize;
+	buf = NULL;
 	while (pfi.flags == 0) {
+		prev_offset = pfi.offset;
+		dc = prlfs_dir_cache_find(FILE_DENTRY(filp), pfi.offset);
+		if (dc) {
+			PRLFS_OP_INC(dir_hit);
+			nr = pfi.offset - dc->pos;
+			off = prlfs_dir_walk(dc->buf, dc->len, &nr);
+			ret = prlfs_fill_dir(filp,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+						ctx,
+#else
+						dirent, filldir,
+#endif
+						&pfi.offset, dc->buf + off,
+						dc->len - off);
+			/* stop if the caller's buffer is full */
+			if (ret < 0 || dc->eof || pfi.offset < dc->pos + dc->nr)
+				break;
+			continue;
+		}
+		PRLFS_OP_INC(dir_miss);
+
+		if (buf == NULL) {
+			buf = prlfs_kvmalloc(buflen);
+			if (buf == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
 		len = buflen;
 		memset(buf, 0, len);
 		ret = host_request_readdir(sb, &pfi, buf, &len);
 		if (ret < 0)
 			break;
+		if (PRLFS_SB(sb)->rdplus)
+			prlfs_readdir_plus(FILE_DENTRY(filp), buf, len);
+		if (prlfs_dir_cache_add(inode, prev_offset, buf, len,
+					pfi.flags != 0)) {
+			pfi.flags = 0;
+			continue;
+		}
 
-		prev_offset = pfi.offset;
 		ret = prlfs_fill_dir(filp,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 					ctx,
@@ -375,13 +607,12 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		if (pfi.offset == prev_offset)
 			break;
 	}
-	kfree(buf);
+	prlfs_kvfree(buf);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 	ctx->pos = pfi.offset;
 #else
 	filp->f_pos = pfi.offset;
 #endif
-out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
@@ -421,6 +652,184 @@ out:
 	return ret;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+/* the host file changed under [pos, end) without going through the cache */
+static void prlfs_host_written(struct file *filp, loff_t pos, loff_t end,
+			       int extend)
+{
+	struct inode *inode = FILE_DENTRY(filp)->d_inode;
+
+	if (end > pos)
+		invalidate_inode_pages2_range(inode->i_mapping,
+			pos >> PAGE_SHIFT, (end - 1) >> PAGE_SHIFT);
+	if (extend && end > i_size_read(inode))
+		i_size_write(inode, end);
+	inode_get_pfd(inode)->cache_written = 1;
+	FILE_DENTRY(filp)->d_time = 0;
+}
+
+/*
+ * There is no host request to zero or copy a range, so both are done with
+ * chunked L_RW requests from a kernel buffer, bypassing the page cache.
+ */
+static ssize_t prlfs_write_zeroes(struct inode *inode, loff_t pos, loff_t len)
+{
+	size_t buflen = min_t(loff_t, len, PRLFS_DIO_MAX_BYTES);
+	ssize_t ret = 0, done = 0;
+	char *buf;
+
+	buf = prlfs_kvmalloc(buflen);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0, buflen);
+	while (done < len) {
+		ret = prlfs_rw(inode, buf, min_t(loff_t, len - done, buflen),
+			       &pos, 1, 0, TG_REQ_COMMON);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+	prlfs_kvfree(buf);
+	return done ? done : ret;
+}
+
+static long prlfs_fallocate(struct file *filp, int mode, loff_t offset,
+			    loff_t len)
+{
+	struct inode *inode = FILE_DENTRY(filp)->d_inode;
+	loff_t end = offset + len;
+	long ret;
+
+	DPRINTK("ENTER inode=%p mode=0x%x off=%lld len=%lld\n",
+		inode, mode, offset, len);
+	PRLFS_OP_INC(fallocate);
+	/* holes and preallocation can not be expressed with writes */
+	if (mode & ~(FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (mode == FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	prlfs_inode_lock(inode);
+	if (!(mode & FALLOC_FL_ZERO_RANGE)) {
+		/* plain allocation only extends, never touches existing data */
+		ret = -EOPNOTSUPP;
+		if (offset < i_size_read(inode))
+			goto out;
+	} else if (mode & FALLOC_FL_KEEP_SIZE) {
+		end = min(end, i_size_read(inode));
+		if (end <= offset) {
+			ret = 0;
+			goto out;
+		}
+	}
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+	}
+
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (ret)
+		goto out;
+	ret = prlfs_write_zeroes(inode, offset, end - offset);
+	if (ret > 0)
+		prlfs_host_written(filp, offset, offset + ret,
+				   !(mode & FALLOC_FL_KEEP_SIZE));
+	if (ret >= 0)
+		ret = (ret == end - offset) ? 0 : -EIO;
+out:
+	prlfs_inode_unlock(inode);
+	DPRINTK("EXIT returning %ld\n", ret);
+	return ret;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+static ssize_t prlfs_copy_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				size_t len)
+{
+	struct inode *in = FILE_DENTRY(file_in)->d_inode;
+	struct inode *out = FILE_DENTRY(file_out)->d_inode;
+	size_t buflen = min_t(size_t, len, PRLFS_DIO_MAX_BYTES);
+	loff_t start = pos_out;
+	ssize_t ret, done = 0, r;
+	char *buf;
+
+	ret = filemap_write_and_wait_range(in->i_mapping, pos_in,
+					   pos_in + len - 1);
+	if (ret)
+		return ret;
+	buf = prlfs_kvmalloc(buflen);
+	if (!buf)
+		return -ENOMEM;
+
+	prlfs_inode_lock(out);
+	ret = file_remove_privs(file_out);
+	if (ret)
+		goto out;
+	ret = filemap_write_and_wait_range(out->i_mapping, pos_out,
+					   pos_out + len - 1);
+	if (ret)
+		goto out;
+	while (done < len) {
+		r = prlfs_rw(in, buf, min_t(size_t, len - done, buflen),
+			     &pos_in, 0, 0, TG_REQ_COMMON);
+		if (r <= 0) {
+			/* e.g. the host handle of the source is write only */
+			ret = (r < 0 && r != -EINTR && !done) ? -EOPNOTSUPP : r;
+			break;
+		}
+		ret = prlfs_rw(out, buf, r, &pos_out, 1, 0, TG_REQ_COMMON);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if (ret < r)
+			break;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+	if (done)
+		prlfs_host_written(file_out, start, start + done, 1);
+out:
+	prlfs_inode_unlock(out);
+	prlfs_kvfree(buf);
+	return done ? done : ret;
+}
+
+static ssize_t prlfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     size_t len, unsigned int flags)
+{
+	ssize_t ret;
+
+	DPRINTK("ENTER in=%lld out=%lld len=%zu\n", pos_in, pos_out, len);
+	PRLFS_OP_INC(copy_range);
+	/* before 5.12 the VFS passes sources of other filesystems too */
+	if (file_in->f_op != file_out->f_op)
+		ret = -EXDEV;
+	else
+		ret = prlfs_copy_range(file_in, pos_in, file_out, pos_out, len);
+	/*
+	 * Only a source we could not read goes through the page cache, the
+	 * VFS does that by itself since generic_copy_file_range() is gone.
+	 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+	if (ret == -EOPNOTSUPP || ret == -EXDEV)
+		ret = generic_copy_file_range(file_in, pos_in, file_out,
+					      pos_out, len, flags);
+#endif
+	DPRINTK("EXIT returning %zd\n", ret);
+	return ret;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
 #ifdef PRL_SIMPLE_SYNC_FILE
 int simple_sync_file(struct file *filp, struct dentry *dentry, int datasync)
@@ -440,13 +849,22 @@ struct file_operations prlfs_file_fops = {
 	.aio_write  = generic_file_aio_write,
 #endif
 	.llseek         = generic_file_llseek,
+	.flush		= prlfs_flush,
 	.release	= prlfs_release,
 	.mmap		= generic_file_mmap,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	.fsync		= prlfs_fsync,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
 	.fsync		= noop_fsync,
 #else
 	.fsync		= simple_sync_file,
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	.fallocate	= prlfs_fallocate,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+	.copy_file_range = prlfs_copy_file_range,
+#endif
 };
 
 struct file_operations prlfs_dir_fops = {
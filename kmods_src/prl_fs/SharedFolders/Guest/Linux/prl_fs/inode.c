@@ -17,6 +17,7 @@
 #include <linux/namei.h>
 #include <linux/cred.h>
 #include <linux/writeback.h>
+#include <linux/vmalloc.h>
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 40)) && \
     (LINUX_VERSION_CODE < KERNEL_VERSION(3, 0, 0))
@@ -37,6 +38,9 @@ extern struct file_operations prlfs_dir_fops;
 extern struct inode *prlfs_iget(struct super_block *sb, ino_t ino);
 
 static struct inode *prlfs_get_inode(struct super_block *sb, prl_umode_t mode);
+static struct inode *prlfs_attr_inode(struct super_block *sb,
+				      struct prlfs_attr *attr);
+static int prlfs_inode_matches(struct inode *inode, struct prlfs_attr *attr);
 struct dentry_operations prlfs_dentry_ops;
 
 #define PRLFS_UID_NOBODY  65534
@@ -56,6 +60,88 @@ unsigned long *prlfs_dfl( struct dentry *de)
 {
 	return (unsigned long *)&(de->d_fsdata);
 }
+
+/* d_fsdata may be swapped by prlfs_dpath_set() at any time */
+void prlfs_dfl_set(struct dentry *de, unsigned long flag)
+{
+	unsigned long *dfl = prlfs_dfl(de), old;
+
+	do {
+		old = *dfl;
+	} while (cmpxchg(dfl, old, old | flag) != old);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+/*
+ * Host path of a dentry, valid while rename_gen of its sb is still gen.
+ * It is read and replaced under d_lock of the dentry.
+ */
+struct prlfs_dpath {
+	int gen;
+	int len;
+	char path[0];
+};
+
+static inline struct prlfs_dpath *prlfs_dpath(struct dentry *de)
+{
+	return (struct prlfs_dpath *)(*prlfs_dfl(de) & ~PRL_DFL_MASK);
+}
+
+static char *prlfs_dpath_get(struct dentry *dentry, char *buf, int *plen)
+{
+	struct prlfs_dpath *dp;
+	char *p = NULL;
+
+	spin_lock(&dentry->d_lock);
+	dp = prlfs_dpath(dentry);
+	if (dp && dp->gen == atomic_read(&PRLFS_SB(dentry->d_sb)->rename_gen) &&
+	    dp->len <= *plen) {
+		memcpy(buf, dp->path, dp->len);
+		*plen = dp->len;
+		p = buf;
+	}
+	spin_unlock(&dentry->d_lock);
+	return p;
+}
+
+static void prlfs_dpath_set(struct dentry *dentry, int gen,
+			    const char *path, int len)
+{
+	unsigned long *dfl = prlfs_dfl(dentry), old, new;
+	struct prlfs_dpath *dp;
+
+	dp = kmalloc(sizeof(*dp) + len, GFP_KERNEL);
+	if (!dp)
+		return;
+	dp->gen = gen;
+	dp->len = len;
+	memcpy(dp->path, path, len);
+	spin_lock(&dentry->d_lock);
+	/* flags are still set without the lock */
+	do {
+		old = *dfl;
+		new = (old & PRL_DFL_MASK) | (unsigned long)dp;
+	} while (cmpxchg(dfl, old, new) != old);
+	spin_unlock(&dentry->d_lock);
+	kfree((void *)(old & ~PRL_DFL_MASK));
+}
+
+static void prlfs_d_release(struct dentry *dentry)
+{
+	kfree(prlfs_dpath(dentry));
+}
+#endif
+
+/*
+ * Only moves of names on this mount change its paths: renames, which do
+ * the d_move() here, and directory aliases moved by d_splice_alias().
+ */
+static void prlfs_rename_gen_bump(struct super_block *sb)
+{
+	smp_wmb();
+	atomic_inc(&PRLFS_SB(sb)->rename_gen);
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
 #define prl_uaccess_kernel() false
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
@@ -97,9 +183,14 @@ static int prepend(char **buffer, int *buflen, const char *str, int namelen)
 
 void *prlfs_get_path(struct dentry *dentry, void *buf, int *plen)
 {
+	struct prlfs_sb_info *sbi = PRLFS_SB(dentry->d_sb);
 	int len;
 	char *p;
 	int ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	int cache = sbi->pathcache && dentry->d_op == &prlfs_dentry_ops;
+	int gen = 0;
+#endif
 
 	DPRINTK("ENTER\n");
 	len = *plen;
@@ -139,20 +230,28 @@ out_lock:
 	if (!IS_ERR(p))
 		*plen -= len;
 #else
+	if (cache) {
+		p = prlfs_dpath_get(dentry, buf, plen);
+		if (p)
+			goto out;
+		p = buf;
+		gen = atomic_read(&sbi->rename_gen);
+		smp_rmb();
+	}
 	p = dentry_path_raw(dentry, p, len);
+	if (IS_ERR(p))
+		goto out;
 #endif
-	ret = prepend(&p, &len,
-		PRLFS_SB(dentry->d_sb)->name,
-		strlen(PRLFS_SB(dentry->d_sb)->name));
-	if (0 == ret)
-		ret = prepend(&p, &len, "/", 1);
+	ret = prepend(&p, &len, sbi->prefix, sbi->prefix_len);
 	if (0 == ret)
 		*plen = strnlen(p, PAGE_SIZE-1) + 1;
 	else
 		p = ERR_PTR(ret);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
-out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	if (cache && !IS_ERR(p))
+		prlfs_dpath_set(dentry, gen, p, *plen);
 #endif
+out:
 	DPRINTK("EXIT returning %p\n", p);
 	return p;
 }
@@ -164,12 +263,11 @@ out:
 						\
 	DPRINTK("ENTER\n");			\
 	buflen = PATH_MAX;			\
-	buf = kmalloc(buflen, GFP_KERNEL);	\
+	buf = prlfs_path_alloc();		\
 	if (buf == NULL) {			\
 		ret = -ENOMEM;			\
 		goto out;			\
 	}					\
-	memset(buf, 0, buflen);			\
 	p = prlfs_get_path((d), buf, &buflen);	\
 	if (IS_ERR(p)) {			\
 		ret = PTR_ERR(p);		\
@@ -179,7 +277,7 @@ out:
 
 #define PRLFS_STD_INODE_TAIL			\
 out_free:					\
-	kfree(buf);				\
+	prlfs_path_free(buf);			\
 out:						\
 	DPRINTK("EXIT returning %d\n", ret);	\
 	return ret;
@@ -196,6 +294,7 @@ static int prlfs_inode_open(struct dentry *dentry, prl_umode_t mode)
 static int prlfs_delete(struct dentry *dentry)
 {
 	PRLFS_STD_INODE_HEAD(dentry)
+	prlfs_release_flush(PRLFS_SB(sb));
 	ret = host_request_remove(dentry->d_sb, p, buflen);
 	PRLFS_STD_INODE_TAIL
 }
@@ -217,6 +316,20 @@ static int do_prlfs_getattr(struct dentry *dentry, struct prlfs_attr *attr)
 #define SET_INODE_INO(inode, ino) do { (inode)->i_ino = ino; } while (0)
 #endif
 
+static inline void prlfs_attr_stamp(struct inode *inode)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+
+	if (pfd && !IS_ERR(pfd))
+		pfd->attr_time = jiffies;
+}
+
+static inline int prlfs_mapping_dirty(struct address_space *mapping)
+{
+	return mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+	       mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK);
+}
+
 static void prlfs_change_attributes(struct inode *inode,
 				    struct prlfs_attr *attr)
 {
@@ -224,7 +337,10 @@ static void prlfs_change_attributes(struct inode *inode,
 
 	if (attr->valid & _PATTR_SIZE) {
 		inode->i_blocks = ((attr->size + PAGE_SIZE - 1) / PAGE_SIZE) * 8;
-		i_size_write(inode, attr->size);
+		/* host size lags behind cached writes until they are flushed */
+		if (!sbi->writeback || attr->size >= i_size_read(inode) ||
+		    !prlfs_mapping_dirty(inode->i_mapping))
+			i_size_write(inode, attr->size);
 	}
 	if (attr->valid & _PATTR_ATIME)
 		SET_INODE_TIME(inode->i_atime, attr->atime);
@@ -246,12 +362,137 @@ static void prlfs_change_attributes(struct inode *inode,
 		else if (sbi->plain)
 			inode->i_gid = prl_make_kgid(attr->gid);
 	}
-	if (sbi->host_inodes && (attr->valid & _PATTR2_INO)) {
+	if (sbi->host_inodes && (attr->valid & _PATTR2_INO) &&
+	    (IS_ERR(inode_get_pfd(inode)) || !inode_get_pfd(inode)->host_ino)) {
 		SET_INODE_INO(inode, attr->ino);
 	}
+	if (S_ISDIR(inode->i_mode)) {
+		struct prlfs_fd *pfd = inode_get_pfd(inode);
+
+		if (pfd && !IS_ERR(pfd)) {
+			if (!pfd->dir_valid || attr->mtime != pfd->dir_mtime)
+				pfd->dir_since = jiffies;
+			pfd->dir_mtime = attr->mtime;
+			pfd->dir_valid = !!(attr->valid & _PATTR_MTIME);
+		}
+	}
 	return;
 }
 
+static void prlfs_set_data_stamp(struct prlfs_fd *pfd, struct prlfs_attr *attr)
+{
+	if (!pfd->cache_valid || attr->mtime != pfd->cache_mtime)
+		pfd->cache_since = jiffies;
+	pfd->cache_mtime = attr->mtime;
+	pfd->cache_size = attr->size;
+	pfd->cache_ino = attr->ino;
+	pfd->cache_stamp = jiffies;
+	pfd->cache_valid = (attr->valid & (_PATTR_MTIME | _PATTR_SIZE)) ==
+			   (_PATTR_MTIME | _PATTR_SIZE);
+	pfd->cache_written = 0;
+}
+
+/*
+ * Host mtime has a resolution of one second, so a file modified again in
+ * the same second keeps its mtime. The change that set cache_mtime was
+ * done before cache_since, so that second is over a second later: only
+ * a state recorded by then is safe. Only the guest clock is compared
+ * with itself, the host and guest clocks may disagree.
+ */
+static int prlfs_data_stamp_racy(struct prlfs_fd *pfd)
+{
+	return time_before(pfd->cache_stamp, pfd->cache_since + HZ);
+}
+
+/*
+ * Close-to-open consistency for regular files: cached pages are kept as
+ * long as the host mtime, size and inode number match the values recorded
+ * when they were last known to be in sync. Called on the first open with
+ * the inode lock held, with the attributes fetched along with the open or
+ * NULL to ask the host now.
+ */
+int prlfs_revalidate_data(struct dentry *dentry, struct prlfs_attr *fetched)
+{
+	struct inode *inode = dentry->d_inode;
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct address_space *mapping = inode->i_mapping;
+	struct prlfs_attr *attr = fetched;
+	loff_t lstart = -1;
+	int ret = 0;
+
+	DPRINTK("ENTER\n");
+	if (!fetched) {
+		attr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
+		if (!attr) {
+			ret = -ENOMEM;
+			goto out_inval;
+		}
+		ret = do_prlfs_getattr(dentry, attr);
+		if (ret < 0)
+			goto out_inval;
+	}
+
+	if (!pfd->cache_valid || !(attr->valid & _PATTR_MTIME) ||
+	    attr->mtime != pfd->cache_mtime || prlfs_data_stamp_racy(pfd) ||
+	    ((attr->valid & _PATTR2_INO) && attr->ino != pfd->cache_ino))
+		lstart = 0;
+	else if (!(attr->valid & _PATTR_SIZE))
+		lstart = 0;
+	else if (attr->size != pfd->cache_size)
+		lstart = min(attr->size, pfd->cache_size);
+
+	if (lstart >= 0)
+		PRLFS_OP_INC(data_miss);
+	else
+		PRLFS_OP_INC(data_hit);
+
+	/* dirty pages of writable mappings must survive the invalidation */
+	if (lstart >= 0 && mapping->nrpages) {
+		filemap_write_and_wait(mapping);
+		if (lstart)
+			invalidate_inode_pages2_range(mapping,
+				lstart >> PAGE_SHIFT, (pgoff_t)-1);
+		else
+			invalidate_inode_pages2(mapping);
+	}
+	DPRINTK("inode %p invalidated from %lld\n", inode, lstart);
+
+	prlfs_change_attributes(inode, attr);
+	prlfs_attr_stamp(inode);
+	prlfs_set_data_stamp(pfd, attr);
+	dentry->d_time = jiffies;
+	if (!fetched)
+		kfree(attr);
+out:
+	DPRINTK("EXIT returning %d\n", ret);
+	return ret;
+
+out_inval:
+	kfree(attr);
+	PRLFS_OP_INC(data_miss);
+	pfd->cache_valid = 0;
+	invalidate_inode_pages2(mapping);
+	goto out;
+}
+
+/*
+ * Called on the last close of a file that was written through this
+ * client: our own writes changed the host mtime, so record the new state
+ * instead of dropping the cache on the next open.
+ */
+void prlfs_record_data(struct dentry *dentry)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(dentry->d_inode);
+	struct prlfs_attr *attr;
+
+	attr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
+	if (attr && do_prlfs_getattr(dentry, attr) == 0)
+		prlfs_set_data_stamp(pfd, attr);
+	else
+		pfd->cache_valid = 0;
+	kfree(attr);
+}
+
 static int attr_to_pattr(struct iattr *attr, struct prlfs_attr *pattr)
 {
 	int ret;
@@ -299,6 +540,7 @@ static int prlfs_mknod(struct inode *dir, struct dentry *dentry,
 	DPRINTK("ENTER\n");
 	ret = 0;
 	dentry->d_time = 0;
+	prlfs_dir_cache_drop(dir);
 	inode = prlfs_get_inode(dir->i_sb, mode);
 	if (inode)
 		d_instantiate(dentry, inode);
@@ -323,6 +565,7 @@ static int prlfs_create(struct inode *dir, struct dentry *dentry,
 	int ret;
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(create);
 	ret = prlfs_inode_open(dentry, mode | S_IFREG);
 	if (ret == 0)
 		ret = prlfs_mknod(dir, dentry, mode | S_IFREG);
@@ -341,6 +584,7 @@ static struct dentry *prlfs_lookup(struct inode *dir, struct dentry *dentry
 	int ret;
 	struct prlfs_attr *attr = 0;
 	struct inode *inode;
+	struct dentry *res = NULL;
 
 	DPRINTK("ENTER\n");
 	DPRINTK("dir ino %lld entry name \"%s\"\n",
@@ -358,29 +602,55 @@ static struct dentry *prlfs_lookup(struct inode *dir, struct dentry *dentry
 		} else
 			goto out_free;
 	} else {
-		inode = prlfs_get_inode(dentry->d_sb, attr->mode);
-		if (inode)
+		inode = prlfs_attr_inode(dentry->d_sb, attr);
+		if (inode) {
 			prlfs_change_attributes(inode, attr);
+			prlfs_attr_stamp(inode);
+		}
 	}
+	PRLFS_STAT_INC(dentry->d_sb, lookup);
 	dentry->d_time = jiffies;
-	d_add(dentry, inode);
 	d_set_d_op(dentry, &prlfs_dentry_ops);
+	res = d_splice_alias(inode, dentry);
+	if (!IS_ERR_OR_NULL(res))
+		prlfs_rename_gen_bump(dentry->d_sb);
 out_free:
 	kfree(attr);
 out:
 	DPRINTK("EXIT returning %d\n", ret);
-	return ERR_PTR(ret);
+	return ret < 0 ? ERR_PTR(ret) : res;
+}
+
+/*
+ * The host may hand the number of a removed file to a new one. A file
+ * still open keeps a fake hash, or writeback would skip its dirty pages.
+ */
+static void prlfs_unhash_host_ino(struct inode *inode)
+{
+	struct prlfs_fd *pfd = inode ? inode_get_pfd(inode) : NULL;
+
+	if (!pfd || IS_ERR(pfd) || !pfd->host_ino)
+		return;
+	remove_inode_hash(inode);
+	if (S_ISREG(inode->i_mode)) {
+		spin_lock(&inode->i_lock);
+		prlfs_hlist_init(inode);
+		spin_unlock(&inode->i_lock);
+	}
 }
 
 static int prlfs_unlink(struct inode *dir, struct dentry *dentry)
 {
         int ret;
-	unsigned long *dfl = prlfs_dfl(dentry);
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(unlink);
 	ret = prlfs_delete(dentry);
-	if (!ret)
-		 *dfl |= PRL_DFL_UNLINKED;
+	if (!ret) {
+		prlfs_dfl_set(dentry, PRL_DFL_UNLINKED);
+		prlfs_unhash_host_ino(dentry->d_inode);
+		prlfs_dir_cache_drop(dir);
+	}
 	DPRINTK("EXIT returning %d\n", ret);
         return ret;
 }
@@ -396,6 +666,7 @@ static int prlfs_mkdir(struct inode *dir, struct dentry *dentry,
 	int ret;
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(mkdir);
 	ret = prlfs_inode_open(dentry, mode | S_IFDIR);
 	if (ret == 0)
 		ret = prlfs_mknod(dir, dentry, mode | S_IFDIR);
@@ -406,12 +677,15 @@ static int prlfs_mkdir(struct inode *dir, struct dentry *dentry,
 static int prlfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
         int ret;
-	unsigned long *dfl = prlfs_dfl(dentry);
 
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(rmdir);
 	ret = prlfs_delete(dentry);
-	if (!ret)
-		*dfl |= PRL_DFL_UNLINKED;
+	if (!ret) {
+		prlfs_dfl_set(dentry, PRL_DFL_UNLINKED);
+		prlfs_unhash_host_ino(dentry->d_inode);
+		prlfs_dir_cache_drop(dir);
+	}
 	DPRINTK("EXIT returning %d\n", ret);
         return ret;
 }
@@ -422,23 +696,30 @@ static int __prlfs_rename(struct inode *old_dir, struct dentry *old_de,
 	void *np, *nbuf;
 	int nbuflen;
 	PRLFS_STD_INODE_HEAD(old_de)
+	PRLFS_OP_INC(rename);
 	nbuflen = PATH_MAX;
-	nbuf = kmalloc(nbuflen, GFP_KERNEL);
+	nbuf = prlfs_path_alloc();
 	if (nbuf == NULL) {
 		ret = -ENOMEM;
 		goto out_free;
 	}
-	memset(nbuf, 0, nbuflen);
 	np = prlfs_get_path(new_de, nbuf, &nbuflen);
 	if (IS_ERR(np)) {
 		ret = PTR_ERR(np);
 		goto out_free_nbuf;
 	}
+	prlfs_release_flush(PRLFS_SB(sb));
 	ret = host_request_rename(sb, p, buflen, np, nbuflen);
+	if (ret == 0) {
+		d_move(old_de, new_de);
+		prlfs_rename_gen_bump(sb);
+	}
 	old_de->d_time = 0;
 	new_de->d_time = 0;
+	prlfs_dir_cache_drop(old_dir);
+	prlfs_dir_cache_drop(new_dir);
 out_free_nbuf:
-	kfree(nbuf);
+	prlfs_path_free(nbuf);
 	PRLFS_STD_INODE_TAIL
 }
 
@@ -505,6 +786,7 @@ static int prlfs_setattr(struct dentry *dentry, struct iattr *attr)
 	struct prlfs_attr *pattr;
 	struct buffer_descriptor bd;
 	PRLFS_STD_INODE_HEAD(dentry)
+	PRLFS_OP_INC(setattr);
 	pattr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
 	if (!pattr) {
 		ret = -ENOMEM;
@@ -518,6 +800,9 @@ static int prlfs_setattr(struct dentry *dentry, struct iattr *attr)
 		ret = - ESTALE;
 		goto out_free_pattr;
 	}
+	/* cached writes must not land beyond the new size */
+	if ((attr->ia_valid & ATTR_SIZE) && PRLFS_SB(sb)->writeback)
+		filemap_write_and_wait(dentry->d_inode->i_mapping);
 	init_buffer_descriptor(&bd, pattr, PATTR_STRUCT_SIZE, 0, 0);
 	ret = host_request_attr(sb, p, buflen, &bd);
 	if (ret == 0)
@@ -528,7 +813,20 @@ out_free_pattr:
 	PRLFS_STD_INODE_TAIL
 }
 
-static int prlfs_i_revalidate(struct dentry *dentry)
+static int prlfs_attr_fresh(struct dentry *dentry)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(dentry->d_inode);
+
+	return dentry->d_time != 0 && !IS_ERR(pfd) && pfd->attr_time != 0 &&
+	       jiffies - pfd->attr_time < PRLFS_SB(dentry->d_sb)->attr_ttl;
+}
+
+/*
+ * Refreshes inode attributes from the host unless they are younger than
+ * attr_ttl. With force set the host is asked anyway, which also confirms
+ * that the name still exists.
+ */
+static int prlfs_i_revalidate(struct dentry *dentry, int force)
 {
 	struct prlfs_attr *attr = 0;
 	struct inode *inode;
@@ -539,11 +837,12 @@ static int prlfs_i_revalidate(struct dentry *dentry)
 		ret = -ENOENT;
 		goto out;
 	}
-	if (dentry->d_time != 0 &&
-	    jiffies - dentry->d_time < PRLFS_SB(dentry->d_sb)->ttl) {
+	if (!force && prlfs_attr_fresh(dentry)) {
+		PRLFS_STAT_INC(dentry->d_sb, attr_hit);
 		ret = 0;
 		goto out;
 	}
+	PRLFS_STAT_INC(dentry->d_sb, attr_miss);
 	attr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
 	if (!attr) {
 		ret = -ENOMEM;
@@ -559,8 +858,12 @@ static int prlfs_i_revalidate(struct dentry *dentry)
 				attr->mode);
 		make_bad_inode(inode);
 		ret = -EIO;
+	} else if (!prlfs_inode_matches(inode, attr)) {
+		/* the name refers to another host file now */
+		ret = -ESTALE;
 	} else {
 		prlfs_change_attributes(inode, attr);
+		prlfs_attr_stamp(inode);
 	}
 	dentry->d_time = jiffies;
 out_free:
@@ -570,6 +873,68 @@ out:
 	return ret;
 }
 
+/*
+ * With dirstamp, tells whether the names of dir are unchanged since the
+ * moment since (in jiffies) they were confirmed. The host mtime of dir,
+ * refreshed within attr_ttl, was set by a change made before dir_since,
+ * when this value was first seen. A name confirmed a second after that
+ * saw the change, and any later change moves the mtime past the value,
+ * given its one second resolution. The host clock is never compared
+ * with the guest one.
+ */
+int prlfs_dir_unchanged_since(struct dentry *dir, unsigned long since)
+{
+	struct prlfs_fd *pfd;
+
+	if (!PRLFS_SB(dir->d_sb)->dirstamp || since == 0)
+		return 0;
+	if (!dir->d_inode || prlfs_i_revalidate(dir, 0) < 0)
+		return 0;
+	pfd = inode_get_pfd(dir->d_inode);
+	if (!pfd || IS_ERR(pfd) || !pfd->dir_valid)
+		return 0;
+	if (time_before(since, pfd->dir_since + HZ))
+		return 0;
+	PRLFS_STAT_INC(dir->d_sb, dir_verified);
+	return 1;
+}
+
+/* d_time is kept, so the next check still compares with the host reply */
+static int prlfs_parent_unchanged(struct dentry *dentry)
+{
+	struct dentry *parent;
+	int ret;
+
+	if (dentry == dentry->d_parent)
+		return 0;
+	parent = dget_parent(dentry);
+	ret = prlfs_dir_unchanged_since(parent, dentry->d_time);
+	dput(parent);
+	return ret;
+}
+
+/*
+ * Negative dentries are trusted for neg_ttl, except when the name is
+ * about to be created, where a stale entry would hide a host file.
+ */
+static int prlfs_neg_revalidate(struct dentry *dentry, unsigned int flags)
+{
+	if (flags & (LOOKUP_CREATE | LOOKUP_RENAME_TARGET))
+		return 0;
+	if (dentry->d_time != 0 &&
+	    jiffies - dentry->d_time < PRLFS_SB(dentry->d_sb)->neg_ttl) {
+		PRLFS_STAT_INC(dentry->d_sb, neg_hit);
+		return 1;
+	}
+	if (!PRLFS_SB(dentry->d_sb)->dirstamp || dentry->d_time == 0)
+		return 0;
+#ifdef LOOKUP_RCU
+	if (flags & LOOKUP_RCU)
+		return -ECHILD;
+#endif
+	return prlfs_parent_unchanged(dentry);
+}
+
 static int prlfs_d_revalidate(struct dentry *dentry,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
 					struct nameidata *nd
@@ -578,29 +943,228 @@ static int prlfs_d_revalidate(struct dentry *dentry,
 #endif
 	)
 {
+	struct super_block *sb = dentry->d_sb;
 	int ret;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+	unsigned int flags = nd ? nd->flags : 0;
+#endif
 
 	DPRINTK("ENTER\n");
-	ret = (prlfs_i_revalidate(dentry) == 0) ? 1 : 0;
+	if (!dentry->d_inode) {
+		ret = prlfs_neg_revalidate(dentry, flags);
+		goto out;
+	}
+	if (dentry->d_time != 0 &&
+	    jiffies - dentry->d_time < PRLFS_SB(sb)->entry_ttl) {
+		PRLFS_STAT_INC(sb, entry_hit);
+		ret = 1;
+		goto out;
+	}
+#ifdef LOOKUP_RCU
+	if (flags & LOOKUP_RCU) {
+		ret = -ECHILD;
+		goto out;
+	}
+#endif
+	if (prlfs_parent_unchanged(dentry)) {
+		ret = 1;
+		goto out;
+	}
+	PRLFS_STAT_INC(sb, revalidate);
+	ret = (prlfs_i_revalidate(dentry, 1) == 0) ? 1 : 0;
+out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
 
 struct dentry_operations prlfs_dentry_ops = {
 	.d_revalidate = prlfs_d_revalidate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	.d_release = prlfs_d_release,
+#endif
 };
 
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+#define prlfs_name_hash(dir, name, len) full_name_hash(dir, name, len)
+#else
+#define prlfs_name_hash(dir, name, len) full_name_hash(name, len)
+#endif
+
+static struct dentry *prlfs_rdplus_lookup(struct dentry *dir, struct qstr *q,
+					  const char *name, int len)
+{
+	q->name = name;
+	q->len = len;
+	q->hash = prlfs_name_hash(dir, name, len);
+	return d_lookup(dir, q);
+}
+
+/* no need to ask the host about dot entries and names with fresh attributes */
+static int prlfs_rdplus_skip(struct dentry *dir, const char *name, int len)
+{
+	struct dentry *dentry;
+	struct qstr q;
+	int skip;
+
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return 1;
+	dentry = prlfs_rdplus_lookup(dir, &q, name, len);
+	if (!dentry)
+		return 0;
+	skip = dentry->d_inode && prlfs_attr_fresh(dentry);
+	dput(dentry);
+	return skip;
+}
+
+/* inode number of a cached name, 0 if the name is not in the dcache */
+ino_t prlfs_cached_ino(struct dentry *dir, const char *name, int len)
+{
+	struct dentry *dentry;
+	struct qstr q;
+	ino_t ino = 0;
+
+	dentry = prlfs_rdplus_lookup(dir, &q, name, len);
+	if (dentry) {
+		if (dentry->d_inode)
+			ino = dentry->d_inode->i_ino;
+		dput(dentry);
+	}
+	return ino;
+}
+
+/*
+ * Puts attributes fetched while reading a directory into the dcache, so
+ * that the stat() storm usually following readdir is served locally.
+ * The directory inode is locked by the caller.
+ */
+static void prlfs_prime_dentry(struct dentry *dir, struct prlfs_attr_req *ar)
+{
+	struct dentry *dentry, *alias;
+	struct inode *inode;
+	struct qstr q;
+
+	dentry = prlfs_rdplus_lookup(dir, &q, ar->name, ar->name_len);
+	if (dentry) {
+		inode = dentry->d_inode;
+		if (!inode)
+			/* the name exists now, let the next lookup ask the host */
+			dentry->d_time = 0;
+		else if (prlfs_inode_matches(inode, &ar->attr)) {
+			prlfs_change_attributes(inode, &ar->attr);
+			prlfs_attr_stamp(inode);
+			dentry->d_time = jiffies;
+		} else
+			dentry->d_time = 0;
+		goto out_put;
+	}
+
+	dentry = d_alloc(dir, &q);
+	if (!dentry)
+		return;
+	inode = prlfs_attr_inode(dir->d_sb, &ar->attr);
+	if (!inode)
+		goto out_put;
+	prlfs_change_attributes(inode, &ar->attr);
+	prlfs_attr_stamp(inode);
+	d_set_d_op(dentry, &prlfs_dentry_ops);
+	dentry->d_time = jiffies;
+	alias = d_splice_alias(inode, dentry);
+	if (!IS_ERR_OR_NULL(alias)) {
+		prlfs_rename_gen_bump(dir->d_sb);
+		dput(alias);
+	}
+	PRLFS_STAT_INC(dir->d_sb, rdplus);
+out_put:
+	dput(dentry);
+}
+
+static void prlfs_rdplus_complete(struct dentry *dir,
+				  struct prlfs_attr_req **batch, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (host_request_attr_wait(batch[i]) == 0)
+			prlfs_prime_dentry(dir, batch[i]);
+		kfree(batch[i]);
+	}
+}
+
+/*
+ * The host readdir reply carries names and types only, so attributes of
+ * the entries in buf are requested asynchronously, up to
+ * PRLFS_RDPLUS_BATCH at a time, and cached together with the dentries.
+ */
+void prlfs_readdir_plus(struct dentry *dir, void *buf, int buflen)
+{
+	struct prlfs_attr_req *batch[PRLFS_RDPLUS_BATCH];
+	struct prlfs_attr_req *ar;
+	struct super_block *sb = dir->d_sb;
+	prlfs_dirent *de;
+	char *dbuf, *dpath;
+	int dlen, offset, name_len, rec_len, nr;
+
+	DPRINTK("ENTER\n");
+	dlen = PATH_MAX;
+	dbuf = prlfs_path_alloc();
+	if (dbuf == NULL)
+		goto out;
+	dpath = prlfs_get_path(dir, dbuf, &dlen);
+	if (IS_ERR(dpath))
+		goto out_free;
+	/* dlen counts the trailing zero, the share root also ends with '/' */
+	dlen--;
+	if (dlen > 0 && dpath[dlen - 1] == '/')
+		dlen--;
+
+	nr = 0;
+	offset = 0;
+	while (offset + sizeof(prlfs_dirent) <= buflen) {
+		de = (prlfs_dirent *)(buf + offset);
+		name_len = de->name_len;
+		rec_len = PRLFS_DIR_REC_LEN(name_len);
+		if (name_len == 0 || rec_len + offset > buflen ||
+		    de->name[name_len] != 0)
+			break;
+		offset += rec_len;
+		if (prlfs_rdplus_skip(dir, de->name, name_len))
+			continue;
+
+		ar = kmalloc(sizeof(*ar) + dlen + name_len + 2, GFP_KERNEL);
+		if (ar == NULL)
+			break;
+		memcpy(ar->path, dpath, dlen);
+		ar->path[dlen] = '/';
+		memcpy(ar->path + dlen + 1, de->name, name_len + 1);
+		ar->psize = dlen + name_len + 2;
+		ar->name = ar->path + dlen + 1;
+		ar->name_len = name_len;
+		host_request_attr_start(sb, ar);
+		batch[nr++] = ar;
+		if (nr == PRLFS_RDPLUS_BATCH) {
+			prlfs_rdplus_complete(dir, batch, nr);
+			nr = 0;
+		}
+	}
+	prlfs_rdplus_complete(dir, batch, nr);
+out_free:
+	prlfs_path_free(dbuf);
+out:
+	DPRINTK("EXIT\n");
+}
+
 inline int __prlfs_getattr(struct dentry *dentry, struct kstat *stat)
 {
 	int ret;
 	DPRINTK("ENTER\n");
+	PRLFS_OP_INC(getattr);
 	if (check_dentry(dentry)) {
 		ret = - ESTALE;
 		goto out;
 	}
 
-	ret = prlfs_i_revalidate(dentry);
+	ret = prlfs_i_revalidate(dentry, 0);
 	if (ret < 0)
 		goto out;
 
@@ -725,14 +1289,14 @@ static char *do_read_symlink(struct dentry *dentry)
 	char *buf, *src_path, *tgt_path;
 	int src_len, tgt_len, ret;
 
+	PRLFS_OP_INC(readlink);
 	tgt_path = NULL;
 	src_len = tgt_len = PATH_MAX;
-	buf = kmalloc(src_len, GFP_KERNEL);
+	buf = prlfs_path_alloc();
 	if (buf == NULL) {
 		tgt_path = ERR_PTR(-ENOMEM);
 		goto out;
 	}
-	memset(buf, 0, src_len);
 	src_path = prlfs_get_path(dentry, buf, &src_len);
 	if (IS_ERR(src_path)) {
 		tgt_path = src_path;
@@ -750,7 +1314,7 @@ static char *do_read_symlink(struct dentry *dentry)
 	} else
 		DPRINTK("tgt '%s'\n", tgt_path);
 out_free:
-	kfree(buf);
+	prlfs_path_free(buf);
 out:
 	return tgt_path;
 }
@@ -804,6 +1368,7 @@ static int prlfs_symlink(struct inode *dir, struct dentry *dentry,
 {
 	PRLFS_STD_INODE_HEAD(dentry)
 	DPRINTK("ENTER symname = '%s'\n", symname);
+	PRLFS_OP_INC(symlink);
 	ret = host_request_symlink(sb, p, buflen, symname, strlen(symname) + 1);
 	if (ret == 0)
 		ret = prlfs_mknod(dir, dentry, S_IFLNK);
@@ -853,73 +1418,673 @@ ssize_t prlfs_rw(struct inode *inode, char *buf, size_t size,
 		                loff_t *off, unsigned int rw, int user, int flags);
 
 
-int prlfs_readpage(struct file *file, struct page *page) {
-	char *buf;
-	ssize_t ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
-	struct inode *inode = file->f_inode;
-#else
-	struct inode *inode = file->f_dentry->d_inode;
-#endif
-	loff_t off = page->index << PAGE_SHIFT;
+/* Maps a run of pages into one virtually contiguous buffer. */
+static char *prlfs_map_pages(struct page **pages, unsigned int nr)
+{
+	if (nr == 1)
+		return kmap(pages[0]);
+	return vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+}
 
-	if (!file) {
-		unlock_page(page);
-		return -EINVAL;
+static void prlfs_unmap_pages(char *buf, struct page **pages, unsigned int nr)
+{
+	if (nr == 1) {
+		kunmap(pages[0]);
+		return;
 	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 34)
+	flush_kernel_vmap_range(buf, nr << PAGE_SHIFT);
+#endif
+	vunmap(buf);
+}
 
-	if (!PageUptodate(page)) {
-		buf = kmap(page);
-		ret = prlfs_rw(inode, buf, PAGE_SIZE, &off, 0, 0, TG_REQ_PF_CTX);
-		if (ret < 0) {
-			kunmap(page);
-			unlock_page(page);
-			return -EIO;
-		}
-		if (ret < PAGE_SIZE)
-			memset(buf + ret, 0, PAGE_SIZE - ret);
-		kunmap(page);
-		flush_dcache_page(page);
-		SetPageUptodate(page);
+/*
+ * Runs of pages hold whole folios, flags, references and locks of each
+ * folio are handled through its first page.
+ */
+#ifdef PRLFS_LARGE_FOLIOS
+#define prlfs_run_step(page)		folio_nr_pages(page_folio(page))
+#define prlfs_flush_dcache(page)	flush_dcache_folio(page_folio(page))
+#else
+#define prlfs_run_step(page)		1
+#define prlfs_flush_dcache(page)	flush_dcache_page(page)
+#endif
+
+/*
+ * With qdepth > 1 readahead, writeback and asynchronous direct reads don't
+ * wait for the host. Up to qdepth L_RW requests per inode are kept in
+ * flight and finished from the toolgate completion context.
+ */
+static struct prlfs_rw_req *prlfs_aio_alloc(struct inode *inode,
+					    unsigned int nr, int nowait)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(inode->i_sb);
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_rw_req *rq;
+
+	if (sbi->qdepth <= 1 || IS_ERR_OR_NULL(pfd))
+		return NULL;
+	if (nowait) {
+		if (!atomic_add_unless(&pfd->aio_inflight, 1, sbi->qdepth))
+			return NULL;
+	} else
+		wait_event(sbi->aio_wait,
+			   atomic_add_unless(&pfd->aio_inflight, 1, sbi->qdepth));
+
+	rq = kmalloc(sizeof(*rq) + nr * sizeof(struct page *), GFP_NOFS);
+	if (!rq) {
+		atomic_dec(&pfd->aio_inflight);
+		wake_up(&sbi->aio_wait);
+		return NULL;
 	}
-	unlock_page(page);
-	return 0;
+	rq->inode = inode;
+	rq->iocb = NULL;
+	rq->nr = 0;
+	return rq;
 }
 
-int prlfs_writepage(struct page *page, struct writeback_control *wbc) {
-	struct inode *inode = page->mapping->host;
-	loff_t i_size = inode->i_size;
-	char *buf;
-	ssize_t ret;
-	int rc = 0;
-	loff_t off = page->index << PAGE_SHIFT;
-	loff_t w_remainder = i_size - off;
+/*
+ * Releases the queue slot. Completions call it while their pages are still
+ * locked or under writeback, which keeps the inode from being evicted.
+ */
+static void prlfs_aio_done(struct prlfs_rw_req *rq)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(rq->inode->i_sb);
 
-	DPRINTK("ENTER page=%p off=%lld\n", page, off);
+	atomic_dec(&inode_get_pfd(rq->inode)->aio_inflight);
+	wake_up(&sbi->aio_wait);
+}
 
-	set_page_writeback(page);
-	buf = kmap(page);
-	ret = prlfs_rw(inode, buf,
-		       w_remainder < PAGE_SIZE ? w_remainder : PAGE_SIZE,
-		       &off, 1, 0, TG_REQ_COMMON);
-	kunmap(page);
-	if (ret < 0) {
-		rc =  -EIO;
-		SetPageError(page);
-		mapping_set_error(page->mapping, rc);
-	}
+static int prlfs_aio_submit(struct prlfs_rw_req *rq, char *buf, size_t size,
+			    loff_t off, unsigned int rw, int user,
+			    void (*end_io)(struct prlfs_rw_req *, int, size_t))
+{
+	struct prlfs_file_info pfi;
+	struct buffer_descriptor bd;
 
-	end_page_writeback(page);
-	unlock_page(page);
-	DPRINTK("EXIT ret=%d\n", rc);
-	return rc;
+	rq->buf = buf;
+	rq->end_io = end_io;
+	init_pfi(&pfi, rq->inode, off, rw);
+	init_buffer_descriptor(&bd, buf, size, rw ? 0 : 1, user);
+	bd.flags = TG_REQ_COMMON;
+	return host_request_rw_async(rq->inode->i_sb, &pfi, &bd, rq);
 }
 
-static int prlfs_write_end(struct file *file, struct address_space *mapping,
-                           loff_t pos, unsigned int len, unsigned int copied,
-                           struct page *page, void *fsdata)
+void prlfs_aio_drain(struct inode *inode)
 {
-	unsigned int from = pos & (PAGE_SIZE - 1);
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+
+	if (IS_ERR_OR_NULL(pfd))
+		return;
+	wait_event(PRLFS_SB(inode->i_sb)->aio_wait,
+		   !atomic_read(&pfd->aio_inflight));
+}
+
+/*
+ * Reads a run of contiguous locked pages with a single host request.
+ * Several pages are mapped into one virtual range, so the whole run goes
+ * to the host as one buffer. Pages are left locked.
+ */
+static int prlfs_read_pages(struct inode *inode, struct page **pages,
+			    unsigned int nr)
+{
+	char *buf;
+	ssize_t ret;
+	size_t size = (size_t)nr << PAGE_SHIFT;
+	loff_t off = (loff_t)pages[0]->index << PAGE_SHIFT;
+	unsigned int i;
+
+	DPRINTK("ENTER inode=%p off=%lld nr=%u\n", inode, off, nr);
+	buf = prlfs_map_pages(pages, nr);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = prlfs_rw(inode, buf, size, &off, 0, 0, TG_REQ_PF_CTX);
+	if (ret >= 0 && ret < size)
+		memset(buf + ret, 0, size - ret);
+	prlfs_unmap_pages(buf, pages, nr);
+out:
+	for (i = 0; ret >= 0 && i < nr; i += prlfs_run_step(pages[i])) {
+		prlfs_flush_dcache(pages[i]);
+		SetPageUptodate(pages[i]);
+	}
+	DPRINTK("EXIT returning %lld\n", (long long)ret);
+	return ret < 0 ? -EIO : 0;
+}
+
+#ifdef PRLFS_LARGE_FOLIOS
+/* reads all pages of a locked folio with one host request */
+static int prlfs_read_whole_folio(struct inode *inode, struct folio *folio)
+{
+	struct page *page = &folio->page, **pages;
+	unsigned int i, nr = folio_nr_pages(folio);
+	int ret;
+
+	if (nr == 1)
+		return prlfs_read_pages(inode, &page, 1);
+	pages = kmalloc(nr * sizeof(struct page *), GFP_NOFS);
+	if (!pages)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		pages[i] = folio_page(folio, i);
+	ret = prlfs_read_pages(inode, pages, nr);
+	kfree(pages);
+	return ret;
+}
+#endif
+
+int prlfs_readpage(struct file *file, struct page *page) {
+	int ret = 0;
+
+	PRLFS_OP_INC(readpage);
+	if (!PageUptodate(page))
+		ret = prlfs_read_pages(page->mapping->host, &page, 1);
+	unlock_page(page);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static int prlfs_read_folio(struct file *file, struct folio *folio)
+{
+#ifdef PRLFS_LARGE_FOLIOS
+	int ret = 0;
+
+	PRLFS_OP_INC(readpage);
+	if (!folio_test_uptodate(folio))
+		ret = prlfs_read_whole_folio(folio->mapping->host, folio);
+	folio_unlock(folio);
+	return ret;
+#else
+	return prlfs_readpage(file, &folio->page);
+#endif
+}
+#endif
+
+static struct page **prlfs_ra_alloc(unsigned int nr_pages, unsigned int *max)
+{
+	*max = min_t(unsigned int, nr_pages, PRLFS_RA_MAX_PAGES);
+	return kmalloc(*max * sizeof(struct page *), GFP_NOFS);
+}
+
+static void prlfs_ra_end_io(struct prlfs_rw_req *rq, int ret, size_t len)
+{
+	size_t size = (size_t)rq->nr << PAGE_SHIFT;
+	unsigned int i;
+
+	DPRINTK("ENTER inode=%p ret=%d len=%zu\n", rq->inode, ret, len);
+	if (!ret && len < size)
+		memset(rq->buf + len, 0, size - len);
+	prlfs_unmap_pages(rq->buf, rq->pages, rq->nr);
+	for (i = 0; !ret && i < rq->nr; i += prlfs_run_step(rq->pages[i])) {
+		prlfs_flush_dcache(rq->pages[i]);
+		SetPageUptodate(rq->pages[i]);
+	}
+	prlfs_aio_done(rq);
+	for (i = 0; i < rq->nr; i += prlfs_run_step(rq->pages[i])) {
+		unlock_page(rq->pages[i]);
+		put_page(rq->pages[i]);
+	}
+	kfree(rq);
+	DPRINTK("EXIT\n");
+}
+
+/* on success the pages are unlocked and released by prlfs_ra_end_io() */
+static int prlfs_ra_submit(struct inode *inode, struct page **pages,
+			   unsigned int nr)
+{
+	struct prlfs_rw_req *rq;
+	char *buf;
+
+	rq = prlfs_aio_alloc(inode, nr, 0);
+	if (!rq)
+		return -EAGAIN;
+	buf = prlfs_map_pages(pages, nr);
+	if (!buf)
+		goto out;
+
+	memcpy(rq->pages, pages, nr * sizeof(struct page *));
+	rq->nr = nr;
+	if (!prlfs_aio_submit(rq, buf, (size_t)nr << PAGE_SHIFT,
+			      (loff_t)pages[0]->index << PAGE_SHIFT, 0, 0,
+			      prlfs_ra_end_io))
+		return 0;
+	prlfs_unmap_pages(buf, pages, nr);
+out:
+	prlfs_aio_done(rq);
+	kfree(rq);
+	return -ENOMEM;
+}
+
+static void prlfs_ra_flush(struct inode *inode, struct page **pages,
+			   unsigned int nr)
+{
+	unsigned int i;
+
+	if (!prlfs_ra_submit(inode, pages, nr))
+		return;
+
+	prlfs_read_pages(inode, pages, nr);
+	for (i = 0; i < nr; i += prlfs_run_step(pages[i])) {
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static void prlfs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct page *page, **pages;
+	unsigned int max, nr;
+#ifdef PRLFS_LARGE_FOLIOS
+	struct folio *folio;
+	unsigned int i, n;
+#endif
+
+	DPRINTK("ENTER inode=%p index=%lu count=%u\n", inode,
+		readahead_index(rac), readahead_count(rac));
+	PRLFS_OP_INC(readahead);
+	pages = prlfs_ra_alloc(readahead_count(rac), &max);
+	if (!pages) {
+		/* fall back to one page per request */
+		pages = &page;
+		max = 1;
+	}
+
+#ifdef PRLFS_LARGE_FOLIOS
+	nr = 0;
+	while ((folio = readahead_folio(rac)) != NULL) {
+		n = folio_nr_pages(folio);
+		if (nr && nr + n > max) {
+			prlfs_ra_flush(inode, pages, nr);
+			nr = 0;
+		}
+		if (n > max) {
+			/* left to ->read_folio() */
+			folio_unlock(folio);
+			continue;
+		}
+		/* readahead_folio() does not leave a reference to the caller */
+		folio_get(folio);
+		for (i = 0; i < n; i++)
+			pages[nr++] = folio_page(folio, i);
+	}
+	if (nr)
+		prlfs_ra_flush(inode, pages, nr);
+#else
+	while ((nr = __readahead_batch(rac, pages, max)) > 0)
+		prlfs_ra_flush(inode, pages, nr);
+#endif
+
+	if (pages != &page)
+		kfree(pages);
+	DPRINTK("EXIT\n");
+}
+#else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+#define prlfs_readahead_gfp_mask(mapping) readahead_gfp_mask(mapping)
+#else
+#define prlfs_readahead_gfp_mask(mapping) mapping_gfp_mask(mapping)
+#endif
+
+static int prlfs_readpages(struct file *file, struct address_space *mapping,
+			   struct list_head *page_list, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	gfp_t gfp = prlfs_readahead_gfp_mask(mapping);
+	struct page **pages;
+	unsigned int max, nr = 0;
+
+	DPRINTK("ENTER inode=%p nr_pages=%u\n", inode, nr_pages);
+	PRLFS_OP_INC(readahead);
+	pages = prlfs_ra_alloc(nr_pages, &max);
+	/* the caller releases pages left on the list */
+	if (!pages)
+		goto out;
+
+	while (!list_empty(page_list)) {
+		struct page *page = list_entry(page_list->prev, struct page, lru);
+
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index, gfp)) {
+			put_page(page);
+			continue;
+		}
+		if (nr && (nr == max || pages[nr - 1]->index + 1 != page->index)) {
+			prlfs_ra_flush(inode, pages, nr);
+			nr = 0;
+		}
+		pages[nr++] = page;
+	}
+	if (nr)
+		prlfs_ra_flush(inode, pages, nr);
+	kfree(pages);
+out:
+	DPRINTK("EXIT\n");
+	return 0;
+}
+#endif
+
+int prlfs_writepage(struct page *page, struct writeback_control *wbc) {
+	struct inode *inode = page->mapping->host;
+	loff_t i_size = inode->i_size;
+	char *buf;
+	ssize_t ret;
+	int rc = 0;
+	loff_t off = page->index << PAGE_SHIFT;
+	loff_t w_remainder = i_size - off;
+	size_t len = w_remainder < PAGE_SIZE ? w_remainder : PAGE_SIZE;
+
+	DPRINTK("ENTER page=%p off=%lld\n", page, off);
+	PRLFS_OP_INC(writepage);
+
+	inode_get_pfd(inode)->cache_written = 1;
+	set_page_writeback(page);
+	buf = kmap(page);
+	ret = prlfs_rw(inode, buf, len, &off, 1, 0, TG_REQ_COMMON);
+	kunmap(page);
+	if (ret < 0) {
+		rc =  -EIO;
+		SetPageError(page);
+		mapping_set_error(page->mapping, rc);
+	}
+
+	end_page_writeback(page);
+	unlock_page(page);
+	DPRINTK("EXIT ret=%d\n", rc);
+	return rc;
+}
+
+struct prlfs_wb_batch {
+	struct inode *inode;
+	struct page **pages;
+	unsigned int nr;
+	unsigned int max;
+	/* index the next page must have to join the run */
+	pgoff_t next;
+	int err;
+};
+
+static void prlfs_wb_end_io(struct prlfs_rw_req *rq, int ret, size_t len)
+{
+	unsigned int i;
+
+	DPRINTK("ENTER inode=%p ret=%d len=%zu\n", rq->inode, ret, len);
+	prlfs_unmap_pages(rq->buf, rq->pages, rq->nr);
+	if (ret)
+		mapping_set_error(rq->inode->i_mapping, -EIO);
+	for (i = 0; ret && i < rq->nr; i += prlfs_run_step(rq->pages[i]))
+		SetPageError(rq->pages[i]);
+	prlfs_aio_done(rq);
+	for (i = 0; i < rq->nr; i += prlfs_run_step(rq->pages[i])) {
+		end_page_writeback(rq->pages[i]);
+		put_page(rq->pages[i]);
+	}
+	kfree(rq);
+	DPRINTK("EXIT\n");
+}
+
+/*
+ * On success writeback of the pages is ended by prlfs_wb_end_io(), errors
+ * are reported through the mapping only.
+ */
+static int prlfs_wb_submit(struct prlfs_wb_batch *wb, size_t size, loff_t off)
+{
+	struct prlfs_rw_req *rq;
+	char *buf;
+
+	rq = prlfs_aio_alloc(wb->inode, wb->nr, 0);
+	if (!rq)
+		return -EAGAIN;
+	buf = prlfs_map_pages(wb->pages, wb->nr);
+	if (!buf)
+		goto out;
+
+	memcpy(rq->pages, wb->pages, wb->nr * sizeof(struct page *));
+	rq->nr = wb->nr;
+	if (!prlfs_aio_submit(rq, buf, size, off, 1, 0, prlfs_wb_end_io))
+		return 0;
+	prlfs_unmap_pages(buf, wb->pages, wb->nr);
+out:
+	prlfs_aio_done(rq);
+	kfree(rq);
+	return -ENOMEM;
+}
+
+/*
+ * Writes the collected run of pages under writeback with a single host
+ * request. An error is recorded for the whole run.
+ */
+static void prlfs_wb_flush(struct prlfs_wb_batch *wb)
+{
+	struct inode *inode = wb->inode;
+	loff_t off = (loff_t)wb->pages[0]->index << PAGE_SHIFT;
+	loff_t w_remainder = i_size_read(inode) - off;
+	size_t size = (size_t)wb->nr << PAGE_SHIFT;
+	unsigned int i;
+	ssize_t ret;
+	int rc = 0;
+	char *buf;
+
+	DPRINTK("ENTER inode=%p off=%lld nr=%u\n", inode, off, wb->nr);
+	inode_get_pfd(inode)->cache_written = 1;
+	if (w_remainder < (loff_t)size)
+		size = w_remainder > 0 ? w_remainder : 0;
+	if (size && !prlfs_wb_submit(wb, size, off))
+		goto out;
+
+	buf = prlfs_map_pages(wb->pages, wb->nr);
+	if (buf) {
+		ret = prlfs_rw(inode, buf, size, &off, 1, 0, TG_REQ_COMMON);
+		prlfs_unmap_pages(buf, wb->pages, wb->nr);
+		if (ret < 0)
+			rc = -EIO;
+	} else
+		rc = -ENOMEM;
+
+	if (rc)
+		mapping_set_error(inode->i_mapping, rc);
+	for (i = 0; i < wb->nr; i += prlfs_run_step(wb->pages[i])) {
+		if (rc)
+			SetPageError(wb->pages[i]);
+		end_page_writeback(wb->pages[i]);
+		put_page(wb->pages[i]);
+	}
+	if (rc && !wb->err)
+		wb->err = rc;
+out:
+	wb->nr = 0;
+	DPRINTK("EXIT ret=%d\n", rc);
+}
+
+#ifdef PRLFS_LARGE_FOLIOS
+/*
+ * Without memory for a page array a large folio is written on its own,
+ * mapped whole if it is in lowmem, with one request per page otherwise.
+ */
+static int prlfs_wb_folio_sync(struct prlfs_wb_batch *wb, struct folio *folio)
+{
+	struct inode *inode = wb->inode;
+	loff_t off = folio_pos(folio);
+	size_t size = min_t(loff_t, folio_size(folio), i_size_read(inode) - off);
+	size_t done, len;
+	ssize_t ret = 0;
+	char *buf;
+	int rc = 0;
+
+	inode_get_pfd(inode)->cache_written = 1;
+	folio_start_writeback(folio);
+	folio_unlock(folio);
+	for (done = 0; done < size; done += len) {
+		len = folio_test_highmem(folio) ?
+		      min_t(size_t, size - done, PAGE_SIZE) : size - done;
+		buf = kmap_local_folio(folio, done);
+		ret = prlfs_rw(inode, buf, len, &off, 1, 0, TG_REQ_COMMON);
+		kunmap_local(buf);
+		if (ret < 0)
+			break;
+	}
+	if (ret < 0) {
+		rc = -EIO;
+		mapping_set_error(inode->i_mapping, rc);
+		folio_set_error(folio);
+		if (!wb->err)
+			wb->err = rc;
+	}
+	folio_end_writeback(folio);
+	return 0;
+}
+
+static int prlfs_writepages_cb(struct folio *folio,
+			       struct writeback_control *wbc, void *data)
+{
+	struct page *page = &folio->page;
+	unsigned int i, n = folio_nr_pages(folio);
+#else
+static int prlfs_writepages_cb(struct page *page, struct writeback_control *wbc,
+			       void *data)
+{
+	unsigned int i, n = 1;
+#endif
+	struct prlfs_wb_batch *wb = data;
+	loff_t off = (loff_t)page->index << PAGE_SHIFT;
+
+	/* page was truncated away after being dirtied */
+	if (off >= i_size_read(wb->inode)) {
+		unlock_page(page);
+		return 0;
+	}
+#ifdef PRLFS_LARGE_FOLIOS
+	/* only the single page fallback is too small for a folio */
+	if (n > wb->max) {
+		if (wb->nr)
+			prlfs_wb_flush(wb);
+		return prlfs_wb_folio_sync(wb, folio);
+	}
+#endif
+
+	if (wb->nr && (wb->nr + n > wb->max || wb->next != page->index))
+		prlfs_wb_flush(wb);
+
+	set_page_writeback(page);
+	get_page(page);
+	unlock_page(page);
+	for (i = 0; i < n; i++)
+		wb->pages[wb->nr++] = nth_page(page, i);
+	wb->next = page->index + n;
+	return 0;
+}
+
+static int prlfs_writepages(struct address_space *mapping,
+			    struct writeback_control *wbc)
+{
+	struct prlfs_wb_batch wb = { .inode = mapping->host };
+	struct page *page;
+	int rc;
+
+	DPRINTK("ENTER inode=%p\n", mapping->host);
+	PRLFS_OP_INC(writepages);
+	wb.max = PRLFS_WB_MAX_PAGES;
+	wb.pages = kmalloc(wb.max * sizeof(struct page *), GFP_NOFS);
+	if (!wb.pages) {
+		/* fall back to one page per request */
+		wb.pages = &page;
+		wb.max = 1;
+	}
+
+	rc = write_cache_pages(mapping, wbc, prlfs_writepages_cb, &wb);
+	if (wb.nr)
+		prlfs_wb_flush(&wb);
+	if (!rc)
+		rc = wb.err;
+
+	if (wb.pages != &page)
+		kfree(wb.pages);
+	DPRINTK("EXIT ret=%d\n", rc);
+	return rc;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define prlfs_grab_write_page(mapping, index, flags) \
+		grab_cache_page_write_begin(mapping, index)
+#else
+#define prlfs_grab_write_page(mapping, index, flags) \
+		grab_cache_page_write_begin(mapping, index, flags)
+#endif
+
+/*
+ * In writeback mode the whole page is sent to the host later, so a partial
+ * write into a page that is not uptodate needs the rest of it read first.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static int prlfs_write_begin(struct file *file, struct address_space *mapping,
+                             loff_t pos, unsigned int len,
+                             struct page **pagep, void **fsdata)
+#else
+static int prlfs_write_begin(struct file *file, struct address_space *mapping,
+                             loff_t pos, unsigned int len, unsigned int flags,
+                             struct page **pagep, void **fsdata)
+#endif
+{
+	struct inode *inode = mapping->host;
+	pgoff_t index = pos >> PAGE_SHIFT;
+	unsigned int from = pos & (PAGE_SIZE - 1);
+	struct page *page;
+	int ret = 0;
+
+	if (!PRLFS_SB(inode->i_sb)->writeback)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		return simple_write_begin(file, mapping, pos, len, pagep, fsdata);
+#else
+		return simple_write_begin(file, mapping, pos, len, flags,
+					  pagep, fsdata);
+#endif
+
+	DPRINTK("ENTER inode=%p pos=%lld len=%u\n", inode, pos, len);
+	page = prlfs_grab_write_page(mapping, index, flags);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	*pagep = page;
+
+	if (PageUptodate(page))
+		goto out;
+#ifdef PRLFS_LARGE_FOLIOS
+	/* a large folio left by readahead only becomes uptodate as a whole */
+	if (folio_test_large(page_folio(page))) {
+		ret = prlfs_read_whole_folio(inode, page_folio(page));
+		goto out_read;
+	}
+#endif
+	if (len == PAGE_SIZE)
+		goto out;
+
+	if (((loff_t)index << PAGE_SHIFT) >= i_size_read(inode)) {
+		zero_user_segments(page, 0, from, from + len, PAGE_SIZE);
+		goto out;
+	}
+
+	ret = prlfs_read_pages(inode, &page, 1);
+#ifdef PRLFS_LARGE_FOLIOS
+out_read:
+#endif
+	if (ret < 0) {
+		unlock_page(page);
+		put_page(page);
+	}
+out:
+	DPRINTK("EXIT ret=%d\n", ret);
+	return ret;
+}
+
+static int prlfs_write_end(struct file *file, struct address_space *mapping,
+                           loff_t pos, unsigned int len, unsigned int copied,
+                           struct page *page, void *fsdata)
+{
+	unsigned int from = pos & (PAGE_SIZE - 1);
 	struct inode *inode = mapping->host;
 	ssize_t ret;
 	loff_t offset = pos;
@@ -927,6 +2092,21 @@ static int prlfs_write_end(struct file *file, struct address_space *mapping,
 
 	DPRINTK("ENTER inode=%p pos=%lld len=%u copied=%u\n", inode, pos, len, copied);
 
+	inode_get_pfd(inode)->cache_written = 1;
+	if (PRLFS_SB(inode->i_sb)->writeback) {
+		/* short copy into a page without valid data, make caller retry */
+		if (!PageUptodate(page) && copied < len)
+			copied = 0;
+		ret = copied;
+		if (!copied)
+			goto out;
+		/* page may be a part of an uptodate large folio */
+		if (!PageUptodate(page))
+			SetPageUptodate(page);
+		set_page_dirty(page);
+		goto out_size;
+	}
+
 	if (!PageUptodate(page) && copied < len)
 		zero_user(page, from + copied, len - copied);
 
@@ -937,9 +2117,10 @@ static int prlfs_write_end(struct file *file, struct address_space *mapping,
 	if (ret < 0)
 		goto out;
 
-	if (!PageUptodate(page) && len == PAGE_SIZE)
+	if (!PageUptodate(page) && len == PAGE_SIZE && !PageCompound(page))
 		SetPageUptodate(page);
 
+out_size:
 	if (pos + copied > inode->i_size)
 		i_size_write(inode, pos + copied);
 
@@ -951,11 +2132,185 @@ out:
 	return ret;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define prlfs_iter_is_kvec(iter) iov_iter_is_kvec(iter)
+#else
+#define prlfs_iter_is_kvec(iter) ((iter)->type & ITER_KVEC)
+#endif
+
+/* single buffer read()/write() and io_uring come as ITER_UBUF since 6.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#define prlfs_iter_is_user(iter) user_backed_iter(iter)
+#else
+#define prlfs_iter_is_user(iter) iter_is_iovec(iter)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define prlfs_iter_iov(iter) iter_iov(iter)
+#else
+#define prlfs_iter_iov(iter) ((iter)->iov)
+#endif
+
+/* the not yet consumed part of the current segment */
+static void prlfs_iter_seg(const struct iov_iter *iter, char **base,
+			   size_t *len)
+{
+	size_t seg;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (iter_is_ubuf(iter)) {
+		*base = (char __force *)iter->ubuf + iter->iov_offset;
+		*len = iov_iter_count(iter);
+		return;
+	}
+#endif
+	if (prlfs_iter_is_kvec(iter)) {
+		*base = (char *)iter->kvec->iov_base + iter->iov_offset;
+		seg = iter->kvec->iov_len;
+	} else {
+		*base = (char __force *)prlfs_iter_iov(iter)->iov_base +
+			iter->iov_offset;
+		seg = prlfs_iter_iov(iter)->iov_len;
+	}
+	*len = min(iov_iter_count(iter), seg - iter->iov_offset);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define prlfs_ki_complete(iocb, res) (iocb)->ki_complete(iocb, res)
+#else
+#define prlfs_ki_complete(iocb, res) (iocb)->ki_complete(iocb, res, 0)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#define prlfs_iocb_nowait(iocb) ((iocb)->ki_flags & IOCB_NOWAIT)
+#else
+#define prlfs_iocb_nowait(iocb) 0
+#endif
+
+static void prlfs_dio_end_io(struct prlfs_rw_req *rq, int ret, size_t len)
+{
+	struct kiocb *iocb = rq->iocb;
+	long res = ret ? ret : (long)len;
+
+	DPRINTK("ENTER inode=%p res=%ld\n", rq->inode, res);
+	if (res > 0)
+		iocb->ki_pos += res;
+	prlfs_aio_done(rq);
+	kfree(rq);
+	prlfs_ki_complete(iocb, res);
+	DPRINTK("EXIT\n");
+}
+
+/*
+ * An AIO or io_uring read fitting one user buffer and one host request is
+ * queued and completed through ki_complete, the submitter doesn't sleep
+ * on the host.
+ */
+static ssize_t prlfs_dio_read_async(struct kiocb *iocb, char *base,
+				    size_t len)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct prlfs_rw_req *rq;
+
+	rq = prlfs_aio_alloc(inode, 0, prlfs_iocb_nowait(iocb));
+	if (!rq)
+		return prlfs_iocb_nowait(iocb) ? -EAGAIN : 0;
+
+	rq->iocb = iocb;
+	if (!prlfs_aio_submit(rq, base, len,
+			      iocb->ki_pos, 0, 1, prlfs_dio_end_io))
+		return -EIOCBQUEUED;
+	prlfs_aio_done(rq);
+	kfree(rq);
+	return 0;
+}
+
+/*
+ * O_DIRECT bypasses the page cache: user buffers are handed to the host
+ * as is, toolgate pins and maps the user pages itself. Other iterator
+ * types return 0 so that the caller falls back to buffered I/O.
+ */
+static ssize_t prlfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	unsigned int rw = (iov_iter_rw(iter) == WRITE) ? 1 : 0;
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret, done = 0;
+	char *base;
+	size_t len;
+	int user;
+
+	DPRINTK("ENTER inode=%p pos=%lld count=%zu rw=%u\n",
+		inode, pos, iov_iter_count(iter), rw);
+	PRLFS_OP_INC(direct_io);
+	if (rw)
+		inode_get_pfd(inode)->cache_written = 1;
+	if (prlfs_iter_is_user(iter))
+		user = 1;
+	else if (prlfs_iter_is_kvec(iter))
+		user = 0;
+	else
+		goto out;
+
+	if (!rw && user && !is_sync_kiocb(iocb)) {
+		prlfs_iter_seg(iter, &base, &len);
+		if (len == iov_iter_count(iter) && len <= PRLFS_DIO_MAX_BYTES) {
+			ret = prlfs_dio_read_async(iocb, base, len);
+			if (ret) {
+				done = ret;
+				goto out;
+			}
+		}
+	}
+	/* host requests always block */
+	if (prlfs_iocb_nowait(iocb)) {
+		done = -EAGAIN;
+		goto out;
+	}
+
+	while (iov_iter_count(iter)) {
+		prlfs_iter_seg(iter, &base, &len);
+		len = min_t(size_t, len, PRLFS_DIO_MAX_BYTES);
+		ret = prlfs_rw(inode, base, len, &pos, rw, user, TG_REQ_COMMON);
+		if (ret < 0) {
+			if (!done)
+				done = ret;
+			break;
+		}
+		iov_iter_advance(iter, ret);
+		done += ret;
+		/* end of file or short write */
+		if (ret < len)
+			break;
+	}
+out:
+	DPRINTK("EXIT returning %zd\n", done);
+	return done;
+}
+#endif
+
 static const struct address_space_operations prlfs_aops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	.read_folio		= prlfs_read_folio,
+#else
 	.readpage		= prlfs_readpage,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	.readahead		= prlfs_readahead,
+#else
+	.readpages		= prlfs_readpages,
+#endif
+#ifndef PRLFS_LARGE_FOLIOS
+	/* ->writepage() of reclaim would only write the first page of a folio */
 	.writepage		= prlfs_writepage,
-	.write_begin    = simple_write_begin,
+#endif
+	.writepages		= prlfs_writepages,
+	.write_begin    = prlfs_write_begin,
 	.write_end      = prlfs_write_end,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	.direct_IO	= prlfs_direct_IO,
+#endif
 	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
 	.dirty_folio	= filemap_dirty_folio,
 	#else
@@ -990,55 +2345,125 @@ struct inode_operations prlfs_root_iops = {
 #define prlfs_current_time(inode) CURRENT_TIME
 #endif
 
+static void prlfs_init_inode(struct inode *inode, prl_umode_t mode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct prlfs_fd* pfd;
+
+	inode->i_mode = mode;
+	inode->i_blocks = 0;
+	inode->i_ctime = prlfs_current_time(inode);
+	inode->i_atime = inode->i_mtime = inode->i_ctime;
+	if (PRLFS_SB(sb)->share) {
+		inode->i_uid = current->cred->uid;
+		inode->i_gid = current->cred->gid;
+	} else {
+		inode->i_uid = PRLFS_SB(sb)->uid;
+		inode->i_gid = PRLFS_SB(sb)->gid;
+	}
+	inode->i_mapping->a_ops = &prlfs_aops;
+
+	pfd = kmalloc(sizeof(struct prlfs_fd), GFP_KERNEL);
+	if (pfd != NULL)
+		memset(pfd, 0, sizeof(struct prlfs_fd));
+	else
+		pfd = ERR_PTR(-ENOMEM);
+	inode_set_pfd(inode, pfd);
+
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		inode->i_op = &prlfs_dir_iops;
+		inode->i_fop = &prlfs_dir_fops;
+		break;
+	case 0: case S_IFREG:
+		inode->i_op = &prlfs_file_iops;
+		inode->i_fop =  &prlfs_file_fops;
+#ifdef PRLFS_LARGE_FOLIOS
+		mapping_set_large_folios(inode->i_mapping);
+#endif
+		break;
+	case S_IFLNK:
+		inode->i_op = &prlfs_symlink_iops;
+		inode->i_fop = &prlfs_file_fops;
+		break;
+	}
+}
+
 static struct inode *prlfs_get_inode(struct super_block *sb, prl_umode_t mode)
 {
 	struct inode * inode;
-	struct prlfs_fd* pfd;
 
 	DPRINTK("ENTER\n");
 	inode = new_inode(sb);
 	if (inode) {
-		inode->i_mode = mode;
-		inode->i_blocks = 0;
-		inode->i_ctime = prlfs_current_time(inode);
-		inode->i_atime = inode->i_mtime = inode->i_ctime;
-		if (PRLFS_SB(sb)->share) {
-			inode->i_uid = current->cred->uid;
-			inode->i_gid = current->cred->gid;
-		} else {
-			inode->i_uid = PRLFS_SB(sb)->uid;
-			inode->i_gid = PRLFS_SB(sb)->gid;
-		}
-		inode->i_mapping->a_ops = &prlfs_aops;
-
-		pfd = kmalloc(sizeof(struct prlfs_fd), GFP_KERNEL);
-		if (pfd != NULL)
-			memset(pfd, 0, sizeof(struct prlfs_fd));
-		else
-			pfd = ERR_PTR(-ENOMEM);
-		inode_set_pfd(inode, pfd);
-
+		prlfs_init_inode(inode, mode);
 		SET_INODE_INO(inode, get_next_ino());
-		switch (mode & S_IFMT) {
-		case S_IFDIR:
-			inode->i_op = &prlfs_dir_iops;
-			inode->i_fop = &prlfs_dir_fops;
-			break;
-		case 0: case S_IFREG:
+		if (S_ISREG(mode) || (mode & S_IFMT) == 0)
 			prlfs_hlist_init(inode);
-			inode->i_op = &prlfs_file_iops;
-			inode->i_fop =  &prlfs_file_fops;
-			break;
-		case S_IFLNK:
-			inode->i_op = &prlfs_symlink_iops;
-			inode->i_fop = &prlfs_file_fops;
-			break;
-		}
 	}
 	DPRINTK("EXIT returning %p\n", inode);
 	return inode;
 }
 
+static int prlfs_ino_test(struct inode *inode, void *data)
+{
+	struct dentry *root = inode->i_sb->s_root;
+
+	/* the root inode lives in the same hash under PRLFS_ROOT_INO */
+	if (root && root->d_inode == inode)
+		return 0;
+	return inode->i_ino == *(ino_t *)data;
+}
+
+static int prlfs_ino_set(struct inode *inode, void *data)
+{
+	inode->i_ino = *(ino_t *)data;
+	return 0;
+}
+
+/*
+ * Returns the inode for a host object. With host_inodes the host inode
+ * number is the inode hash key, so hard links and repeated lookups of
+ * the same file share one inode with a stable i_ino.
+ */
+static struct inode *prlfs_attr_inode(struct super_block *sb,
+				      struct prlfs_attr *attr)
+{
+	struct inode *inode;
+	ino_t ino = attr->ino;
+
+	if (!PRLFS_SB(sb)->host_inodes || !(attr->valid & _PATTR2_INO))
+		return prlfs_get_inode(sb, attr->mode);
+
+	inode = iget5_locked(sb, ino, prlfs_ino_test, prlfs_ino_set, &ino);
+	if (!inode)
+		return NULL;
+	if (inode->i_state & I_NEW) {
+		prlfs_init_inode(inode, attr->mode);
+		if (!IS_ERR(inode_get_pfd(inode)))
+			inode_get_pfd(inode)->host_ino = 1;
+		unlock_new_inode(inode);
+	} else if ((inode->i_mode ^ attr->mode) & S_IFMT) {
+		/* the number now belongs to an object of another type */
+		iput(inode);
+		inode = prlfs_get_inode(sb, attr->mode);
+	}
+	return inode;
+}
+
+/* checks that a cached inode still describes the host object */
+static int prlfs_inode_matches(struct inode *inode, struct prlfs_attr *attr)
+{
+	struct prlfs_fd *pfd = inode_get_pfd(inode);
+
+	if ((inode->i_mode ^ attr->mode) & S_IFMT)
+		return 0;
+	if (!IS_ERR(pfd) && pfd->host_ino && (attr->valid & _PATTR2_INO) &&
+	    inode->i_ino != (ino_t)attr->ino)
+		return 0;
+	return 1;
+}
+
 void prlfs_read_inode(struct inode *inode)
 {
 	ino_t ino = inode->i_ino;
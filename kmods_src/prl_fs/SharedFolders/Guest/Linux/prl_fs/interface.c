@@ -81,6 +81,7 @@ static void init_req_desc(TG_REQ_DESC *sdesc, TG_REQUEST *src,
 	sdesc->sbuf = sbuf;
 	sdesc->flags = 0;
 	sdesc->kernel_bufs = 0;
+	sdesc->ubufs = NULL;
 }
 
 static void init_tg_request(TG_REQUEST *src, unsigned request,
@@ -178,12 +179,50 @@ int host_request_attr(struct super_block *sb, const char *path, int psize,
 	return ret;
 }
 
+/*
+ * Asynchronous variant of host_request_attr(), used to fetch attributes of
+ * many names at once. ar->path and ar->psize must be set by the caller.
+ */
+void host_request_attr_start(struct super_block *sb, struct prlfs_attr_req *ar)
+{
+	void *idata = NULL;
+	int ibc = 0;
+	TG_BUFFER *tgb = (TG_BUFFER *)&ar->Req.i;
+
+	memset(&ar->Req, 0, sizeof(ar->Req));
+	if (PRLFS_SB(sb)->host_inodes) {
+		idata = &ar->Req.i;
+		ibc = sizeof(&ar->Req.i);
+		tgb = &ar->Req.Buffer[0];
+		ar->Req.i.flags |= PRLFS_SFF_HOST_INODES;
+	}
+
+	init_tg_request(&ar->Req.Req, TG_REQUEST_FS_L_ATTR, ibc, 2);
+	init_req_desc(&ar->sdesc, &ar->Req.Req, idata, tgb);
+	init_tg_buffer(&ar->sdesc, 0, ar->path, ar->psize, 0, 0);
+	init_tg_buffer(&ar->sdesc, 1, &ar->attr, PATTR_STRUCT_SIZE, 1, 0);
+	/* stays pending only if the request could not be created at all */
+	ar->Req.Req.Status = TG_STATUS_PENDING;
+	ar->pending = call_tg_async_start(PRLTG_SB(sb), &ar->sdesc);
+}
+
+int host_request_attr_wait(struct prlfs_attr_req *ar)
+{
+	call_tg_async_wait(ar->pending);
+	ar->pending = NULL;
+	if (ar->Req.Req.Status == TG_STATUS_PENDING)
+		return -ENOMEM;
+	if (ar->Req.Req.Status != TG_STATUS_SUCCESS)
+		return -TG_ERR(ar->Req.Req.Status);
+	return 0;
+}
+
 int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 			const char *p, int plen)
 {
 	int ret;
 	TG_REQ_DESC sdesc;
-	struct prlfs_file_desc *pfd;
+	struct prlfs_file_desc pfd;
 	struct {
 		TG_REQUEST Req;
 		struct {
@@ -195,10 +234,7 @@ int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 	int ibc = 0;
 	TG_BUFFER *tgb = (TG_BUFFER *)&Req.i;
 
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
-	if (!pfd)
-		return -ENOMEM;
-	prlfs_file_info_to_desc(pfd, pfi);
+	prlfs_file_info_to_desc(&pfd, pfi);
 
 	memset(&Req, 0, sizeof(Req));
 	if (PRLFS_SB(sb)->host_inodes) {
@@ -211,13 +247,12 @@ int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 	init_tg_request(&Req.Req, TG_REQUEST_FS_L_OPEN, ibc, 2);
 	init_req_desc(&sdesc, &Req.Req, idata, tgb);
 	init_tg_buffer(&sdesc, 0, (void *)p, plen, 0, 0);
-	init_tg_buffer(&sdesc, 1, (void *)pfd, PFD_LEN, 1, 0);
+	init_tg_buffer(&sdesc, 1, (void *)&pfd, PFD_LEN, 1, 0);
 	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
 	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS))
 		ret = -TG_ERR(Req.Req.Status);
 
-	prlfs_file_desc_to_info(pfi, pfd);
-	kfree(pfd);
+	prlfs_file_desc_to_info(pfi, &pfd);
 	return ret;
 }
 
@@ -226,20 +261,18 @@ int host_request_release(struct super_block *sb, struct prlfs_file_info *pfi)
 	int ret;
 	int retry = 1000;
 	TG_REQ_DESC sdesc;
-	struct prlfs_file_desc *pfd;
+	struct prlfs_file_desc pfd;
 	struct {
 		TG_REQUEST Req;
 		TG_BUFFER Buffer;
 	} Req;
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
-	if (!pfd)
-		return -ENOMEM;
+
 retry:
-	prlfs_file_info_to_desc(pfd, pfi);
+	prlfs_file_info_to_desc(&pfd, pfi);
 	memset(&Req, 0, sizeof(Req));
 	init_tg_request(&Req.Req, TG_REQUEST_FS_L_RELEASE, 0, 1);
 	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer);
-	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&sdesc, 0, (void *)&pfd, PFD_LEN, 0, 0);
 	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
 	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS)) {
 		if (Req.Req.Status == TG_STATUS_CANCELLED) {
@@ -250,30 +283,51 @@ retry:
 			ret = -TG_ERR(Req.Req.Status);
 		}
 	}
-	kfree(pfd);
 	return ret;
 }
 
+/* asynchronous variant of host_request_release(), rr->pfd must be set */
+void host_request_release_start(struct tg_dev *dev,
+				struct prlfs_release_req *rr)
+{
+	memset(&rr->Req, 0, sizeof(rr->Req));
+	init_tg_request(&rr->Req.Req, TG_REQUEST_FS_L_RELEASE, 0, 1);
+	init_req_desc(&rr->sdesc, &rr->Req.Req, NULL, &rr->Req.Buffer);
+	init_tg_buffer(&rr->sdesc, 0, (void *)&rr->pfd, PFD_LEN, 0, 0);
+	/* stays pending only if the request could not be created at all */
+	rr->Req.Req.Status = TG_STATUS_PENDING;
+	rr->pending = call_tg_async_start(dev, &rr->sdesc);
+}
+
+int host_request_release_wait(struct prlfs_release_req *rr)
+{
+	call_tg_async_wait(rr->pending);
+	rr->pending = NULL;
+	if (rr->Req.Req.Status == TG_STATUS_PENDING)
+		return -ENOMEM;
+	if (rr->Req.Req.Status == TG_STATUS_CANCELLED)
+		return -ERESTARTSYS;
+	if (rr->Req.Req.Status != TG_STATUS_SUCCESS)
+		return -TG_ERR(rr->Req.Req.Status);
+	return 0;
+}
+
 int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
 			 void *buf, int *buflen)
 {
 	int ret;
 	TG_REQ_DESC sdesc;
-	struct prlfs_file_desc *pfd;
+	struct prlfs_file_desc pfd;
 	struct {
 		TG_REQUEST Req;
 		TG_BUFFER Buffer[2];
 	} Req;
 
-
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
-	if (!pfd)
-		return -ENOMEM;
-	prlfs_file_info_to_desc(pfd, pfi);
+	prlfs_file_info_to_desc(&pfd, pfi);
 	memset(&Req, 0, sizeof(Req));
 	init_tg_request(&Req.Req, TG_REQUEST_FS_L_READDIR, 0, 2);
 	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
-	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 1, 0);
+	init_tg_buffer(&sdesc, 0, (void *)&pfd, PFD_LEN, 1, 0);
 	init_tg_buffer(&sdesc, 1, buf, *buflen, 1, 0);
 	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
 	if (ret == 0) {
@@ -282,8 +336,7 @@ int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
 		else
 			ret = -TG_ERR(Req.Req.Status);
 	}
-	prlfs_file_desc_to_info(pfi, pfd);
-	kfree(pfd);
+	prlfs_file_desc_to_info(pfi, &pfd);
 	return ret;
 }
 
@@ -292,20 +345,17 @@ int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 {
 	int ret;
 	TG_REQ_DESC sdesc;
-	struct prlfs_file_desc *pfd;
+	struct prlfs_file_desc pfd;
 	struct {
 		TG_REQUEST Req;
 		TG_BUFFER Buffer[2];
 	} Req;
 
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
-	if (!pfd)
-		return -ENOMEM;
-	prlfs_file_info_to_desc(pfd, pfi);
+	prlfs_file_info_to_desc(&pfd, pfi);
 	memset(&Req, 0, sizeof(Req));
 	init_tg_request(&Req.Req, TG_REQUEST_FS_L_RW, 0, 2);
 	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
-	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&sdesc, 0, (void *)&pfd, PFD_LEN, 0, 0);
 	init_tg_buffer(&sdesc, 1, bd->buf, bd->len, bd->write, bd->user);
 	sdesc.flags = bd->flags;
 	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
@@ -315,10 +365,39 @@ int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 		else
 			ret = -TG_ERR(Req.Req.Status);
 	}
-	kfree(pfd);
 	return ret;
 }
 
+static void host_request_rw_end_io(TG_REQ_DESC *sdesc, void *data)
+{
+	struct prlfs_rw_req *rq = data;
+
+	if (rq->Req.Req.Status == TG_STATUS_SUCCESS)
+		rq->end_io(rq, 0, rq->Req.Buffer[1].ByteCount);
+	else if (rq->Req.Req.Status == TG_STATUS_PENDING)
+		rq->end_io(rq, -ENOMEM, 0);
+	else
+		rq->end_io(rq, -TG_ERR(rq->Req.Req.Status), 0);
+}
+
+/*
+ * Asynchronous variant of host_request_rw(), rq->end_io is called when the
+ * host is done unless an error is returned. bd->buf must stay mapped.
+ */
+int host_request_rw_async(struct super_block *sb, struct prlfs_file_info *pfi,
+			  struct buffer_descriptor *bd, struct prlfs_rw_req *rq)
+{
+	prlfs_file_info_to_desc(&rq->pfd, pfi);
+	memset(&rq->Req, 0, sizeof(rq->Req));
+	init_tg_request(&rq->Req.Req, TG_REQUEST_FS_L_RW, 0, 2);
+	init_req_desc(&rq->sdesc, &rq->Req.Req, NULL, &rq->Req.Buffer[0]);
+	init_tg_buffer(&rq->sdesc, 0, (void *)&rq->pfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&rq->sdesc, 1, bd->buf, bd->len, bd->write, bd->user);
+	rq->sdesc.flags = bd->flags;
+	return call_tg_async_submit(PRLTG_SB(sb), &rq->sdesc,
+				    host_request_rw_end_io, rq);
+}
+
 int host_request_remove(struct super_block *sb, void *buf, int buflen)
 {
 	int ret;
@@ -15,6 +15,8 @@
 #include <linux/types.h>
 #include <linux/stat.h>
 #include <linux/fcntl.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
 
 #include <linux/version.h>
 #ifdef RHEL_RELEASE_CODE
@@ -112,19 +114,124 @@ typedef gid_t kgid_t;
 #define prlfs_bdi_destroy(bdi) bdi_destroy(bdi)
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+#define prlfs_kvmalloc(size) kvmalloc(size, GFP_KERNEL)
+#define prlfs_kvfree(p) kvfree(p)
+#else
+#define prlfs_kvmalloc(size) vmalloc(size)
+#define prlfs_kvfree(p) vfree(p)
+#endif
+
+/*
+ * Metadata cache counters, shown in /proc/self/mountstats and summed over
+ * the mounts in /proc/fs/prl_fs/stats.
+ */
+struct prlfs_cache_stats {
+	atomic_long_t entry_hit;
+	atomic_long_t neg_hit;
+	atomic_long_t revalidate;
+	atomic_long_t lookup;
+	atomic_long_t attr_hit;
+	atomic_long_t attr_miss;
+	atomic_long_t rdplus;
+	atomic_long_t dir_verified;
+};
+
+/* VFS calls and data cache results of all mounts, see prlfs_cache_stats */
+struct prlfs_op_stats {
+	unsigned long create;
+	unsigned long mkdir;
+	unsigned long symlink;
+	unsigned long unlink;
+	unsigned long rmdir;
+	unsigned long rename;
+	unsigned long getattr;
+	unsigned long setattr;
+	unsigned long readlink;
+	unsigned long open;
+	unsigned long release;
+	unsigned long fsync;
+	unsigned long readdir;
+	unsigned long readpage;
+	unsigned long readahead;
+	unsigned long writepage;
+	unsigned long writepages;
+	unsigned long direct_io;
+	unsigned long fallocate;
+	unsigned long copy_range;
+	unsigned long dir_hit;
+	unsigned long dir_miss;
+	unsigned long data_hit;
+	unsigned long data_miss;
+};
+
+DECLARE_PER_CPU(struct prlfs_op_stats, prlfs_op_stats);
+
+#define PRLFS_OP_INC(field) do { \
+	get_cpu_var(prlfs_op_stats).field++; \
+	put_cpu_var(prlfs_op_stats); \
+} while (0)
+
+#define PRLFS_STAT_INC(sb, field) \
+	atomic_long_inc(&PRLFS_SB(sb)->cstats.field)
+
 struct prlfs_sb_info {
 	struct backing_dev_info bdi;
 	struct	tg_dev *pdev;
 	unsigned sfid;
-	unsigned ttl;
+	/* cache lifetimes in jiffies */
+	unsigned attr_ttl;
+	unsigned entry_ttl;
+	unsigned neg_ttl;
+	/* size of the host readdir buffer */
+	unsigned rdsize;
+	/* L_RW requests per inode sent without waiting, 1 keeps I/O synchronous */
+	unsigned qdepth;
+	wait_queue_head_t aio_wait;
+	struct prlfs_cache_stats cstats;
+	/* on prlfs_sbs, for the stats of all mounts */
+	struct list_head sbs;
 	kuid_t uid;
 	kgid_t gid;
 	int readonly;
 	int share;
 	int plain;
 	int host_inodes;
+	int writeback;
+	int rdplus;
+	int pathcache;
+	int dirstamp;
+	int lazyrelease;
+	/* bumped after every move of a name, cached paths are of one value */
+	atomic_t rename_gen;
+	/* L_RELEASE requests of closed files, queued and in flight */
+	spinlock_t release_lock;
+	struct list_head release_queue;
+	atomic_t releases;
+	struct mutex release_mutex;
+	struct delayed_work release_work;
 	char nls[LOCALE_NAME_LEN];
 	char name[NAME_MAX];
+	/* "/<name>", put in front of every host path */
+	char prefix[NAME_MAX + 2];
+	int prefix_len;
+};
+
+/* host readdir reply kept for reuse, holds entries [pos, pos + nr) */
+struct prlfs_dir_chunk {
+	struct list_head	list;
+	loff_t			pos;
+	int			nr;
+	int			len;
+	int			eof;
+	void			*buf;
+};
+
+/* directory stream of an inode, protected by the directory inode lock */
+struct prlfs_dir_cache {
+	struct list_head	chunks;
+	int			nr_chunks;
+	unsigned long		stamp;
 };
 
 struct prlfs_fd {
@@ -132,6 +239,25 @@ struct prlfs_fd {
 	unsigned int		sfid;
 	unsigned long long	f_counter;
 	unsigned int		f_flags;
+	unsigned long		attr_time;
+	/* hashed by the host inode number */
+	int			host_ino;
+	struct prlfs_dir_cache	*dir_cache;
+	/* host state the cached file data corresponds to */
+	unsigned long long	cache_mtime;
+	unsigned long long	cache_size;
+	unsigned long long	cache_ino;
+	/* jiffies of the last sync and of the first sight of cache_mtime */
+	unsigned long		cache_stamp;
+	unsigned long		cache_since;
+	int			cache_valid;
+	int			cache_written;
+	/* host mtime of a directory, valid with dir_valid, first seen then */
+	unsigned long long	dir_mtime;
+	unsigned long		dir_since;
+	int			dir_valid;
+	/* asynchronous L_RW requests in flight */
+	atomic_t		aio_inflight;
 };
 
 #define inode_get_pfd(inode)  ((struct prlfs_fd *)(inode)->i_private)
@@ -165,6 +291,11 @@ struct buffer_descriptor {
 void init_buffer_descriptor(struct buffer_descriptor *bd, void *buf,
 			    unsigned long long len, int write, int user);
 
+/* PATH_MAX sized buffers for prlfs_get_path(), not zeroed */
+extern struct kmem_cache *prlfs_path_cachep;
+#define prlfs_path_alloc() kmem_cache_alloc(prlfs_path_cachep, GFP_KERNEL)
+#define prlfs_path_free(buf) kmem_cache_free(prlfs_path_cachep, buf)
+
 void *prlfs_get_path(struct dentry *dentry, void *buf, int *plen);
 
 static inline struct prlfs_sb_info * PRLFS_SB(struct super_block *sb)
@@ -178,6 +309,16 @@ static inline struct tg_dev * PRLTG_SB(struct super_block *sb)
 }
 
 void prlfs_read_inode(struct inode *inode);
+int prlfs_revalidate_data(struct dentry *dentry, struct prlfs_attr *fetched);
+int prlfs_dir_unchanged_since(struct dentry *dir, unsigned long since);
+void prlfs_record_data(struct dentry *dentry);
+void prlfs_readdir_plus(struct dentry *dir, void *buf, int buflen);
+ino_t prlfs_cached_ino(struct dentry *dir, const char *name, int len);
+void prlfs_dir_cache_drop(struct inode *inode);
+void prlfs_aio_drain(struct inode *inode);
+void prlfs_release_init(struct prlfs_sb_info *sbi);
+void prlfs_release_flush(struct prlfs_sb_info *sbi);
+void prlfs_release_destroy(struct prlfs_sb_info *sbi);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 #define d_set_d_op(_dentry, _d_op)	do { _dentry->d_op = _d_op; } while (0)
@@ -190,15 +331,71 @@ int host_request_sf_param(struct tg_dev *pdev, void *data, int size,
 					 struct prlfs_sf_parameters *psp);
 int host_request_attr (struct super_block *sb, const char *path, int psize,
 						struct buffer_descriptor *bd);
+
+/* L_ATTR request in flight, must stay allocated until it is waited for */
+struct prlfs_attr_req {
+	struct {
+		TG_REQUEST Req;
+		struct {
+			unsigned flags;
+		} i;
+		TG_BUFFER Buffer[2];
+	} Req;
+	TG_REQ_DESC sdesc;
+	struct TG_PENDING_REQUEST *pending;
+	struct prlfs_attr attr;
+	const char *name;
+	int name_len;
+	int psize;
+	char path[0];
+};
+
+void host_request_attr_start(struct super_block *sb, struct prlfs_attr_req *ar);
+int host_request_attr_wait(struct prlfs_attr_req *ar);
 int host_request_mount(struct super_block *sb,
 				 struct prlfs_sf_parameters *psp);
 int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 						const char *p, int plen);
 int host_request_release(struct super_block *sb, struct prlfs_file_info *pfi);
+
+/* L_RELEASE deferred from the last close, sent in batches */
+struct prlfs_release_req {
+	struct list_head list;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer;
+	} Req;
+	TG_REQ_DESC sdesc;
+	struct TG_PENDING_REQUEST *pending;
+	struct prlfs_file_desc pfd;
+};
+
+void host_request_release_start(struct tg_dev *dev,
+				struct prlfs_release_req *rr);
+int host_request_release_wait(struct prlfs_release_req *rr);
 int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
 						 void *buf, int *buflen);
 int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 						 struct buffer_descriptor *bd);
+
+/* L_RW request in flight, end_io gets the host error or the bytes done */
+struct prlfs_rw_req {
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer[2];
+	} Req;
+	TG_REQ_DESC sdesc;
+	struct prlfs_file_desc pfd;
+	void (*end_io)(struct prlfs_rw_req *rq, int ret, size_t len);
+	struct inode *inode;
+	struct kiocb *iocb;
+	char *buf;
+	unsigned int nr;
+	struct page *pages[0];
+};
+
+int host_request_rw_async(struct super_block *sb, struct prlfs_file_info *pfi,
+			  struct buffer_descriptor *bd, struct prlfs_rw_req *rq);
 int host_request_remove(struct super_block *sb, void *buf, int buflen);
 int host_request_rename(struct super_block *sb, void *buf, size_t buflen,
 				void *nbuf, size_t nlen);
@@ -236,6 +433,39 @@ int host_request_symlink(struct super_block *sb, const void *src_path, int src_l
 #define DRV_VERSION	"2.1.0"
 #define PFX		MODNAME ": "
 
+/*
+ * Regular files are cached in large folios once writeback hands folios to
+ * ->writepages(). Runs of pages sent to the host then hold whole folios.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define PRLFS_LARGE_FOLIOS
+#endif
+
+/* upper bounds of a single readahead and writeback request */
+#ifdef PRLFS_LARGE_FOLIOS
+/* a request holds at least one folio of the largest order */
+#define PRLFS_RA_MAX_PAGES	max_t(unsigned int, (1024 * 1024) >> PAGE_SHIFT, \
+				      1U << MAX_PAGECACHE_ORDER)
+#define PRLFS_WB_MAX_PAGES	PRLFS_RA_MAX_PAGES
+#else
+#define PRLFS_RA_MAX_PAGES	((1024 * 1024) >> PAGE_SHIFT)
+#define PRLFS_WB_MAX_PAGES	((1024 * 1024) >> PAGE_SHIFT)
+#endif
+/* largest chunk of a direct I/O request */
+#define PRLFS_DIO_MAX_BYTES	(4 * 1024 * 1024)
+/* upper bound of asynchronous L_RW requests per inode */
+#define PRLFS_QDEPTH_MAX	64
+/* host readdir buffer size, replies cached per directory and in total */
+#define PRLFS_RDSIZE_DEFAULT	(64 * 1024)
+#define PRLFS_RDSIZE_MAX	(256 * 1024)
+#define PRLFS_DIR_CACHE_CHUNKS	64
+#define PRLFS_DIR_CACHE_BYTES	(16 * 1024 * 1024)
+/* attribute requests kept in flight while priming a directory */
+#define PRLFS_RDPLUS_BATCH	32
+/* deferred releases sent at once, and how long closed files wait for more */
+#define PRLFS_RELEASE_BATCH	32
+#define PRLFS_RELEASE_DELAY	(HZ / 20)
+
 #define PRLFS_ROOT_INO 2
 #define PRLFS_GOOD_INO 8
 #define ID_STR_LEN 16
@@ -252,6 +482,9 @@ enum {
 	PRL_DFL_TAG = 0x1UL, /* tagged detnry, used for debuging purposes */
 	PRL_DFL_UNLINKED = 0x2UL, /* Unlinked dentry. */
 };
+/* the rest of d_fsdata points to a cached path with the pathcache option */
+#define PRL_DFL_MASK	0x3UL
 
 unsigned long *prlfs_dfl( struct dentry *de);
+void prlfs_dfl_set(struct dentry *de, unsigned long flag);
 #endif /* __PRL_FS_H__ */
@@ -0,0 +1,634 @@
+/*
+ *   prlfs/prlfs_bench.c
+ *
+ *   Copyright (C) 1999-2016 Parallels International GmbH
+ *
+ *   Parallels linux shared folders filesystem
+ *
+ *   Benchmark of data and metadata workloads on a mounted shared folder.
+ *   Prints the mount options once, then one line of key=value pairs per
+ *   workload with its throughput, latency percentiles and the changes of
+ *   the /proc/fs/prl_fs/stats counters it caused.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+
+#define STATS_FILE	"/proc/fs/prl_fs/stats"
+#define MAX_STATS	64
+#define MAX_LIST	8
+#define LOOKUP_DIRS	50
+#define LOOKUP_FILES	20
+#define LOOKUP_PATHS	8	/* include directories searched per header */
+
+struct list {
+	unsigned long long v[MAX_LIST];
+	int nr;
+};
+
+struct stats {
+	char name[MAX_STATS][32];
+	unsigned long long v[MAX_STATS];
+	int nr;
+};
+
+struct lat {
+	unsigned long long *v;
+	size_t nr, max;
+};
+
+static struct {
+	char *dir;			/* work directory inside the share */
+	unsigned long long file_size;
+	struct list bs;
+	struct list dirs;
+	unsigned int rand_ops;
+	unsigned int files;
+	int drop_caches;
+	const char *workloads;
+} b = {
+	.file_size = 256ULL << 20,
+	.rand_ops = 10000,
+	.files = 10000,
+};
+
+static struct stats stats_before;
+static char *buf;
+
+static void die(const char *what)
+{
+	fprintf(stderr, "prlfs_bench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, unsigned long long ns)
+{
+	if (l->nr == l->max) {
+		l->max = l->max ? 2 * l->max : 4096;
+		l->v = realloc(l->v, l->max * sizeof(*l->v));
+		if (!l->v)
+			die("realloc");
+	}
+	l->v[l->nr++] = ns;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void stats_read(struct stats *s)
+{
+	FILE *f = fopen(STATS_FILE, "r");
+
+	s->nr = 0;
+	if (!f)
+		return;
+	while (s->nr < MAX_STATS &&
+	       fscanf(f, "%31[^:]: %llu\n", s->name[s->nr], &s->v[s->nr]) == 2)
+		s->nr++;
+	fclose(f);
+}
+
+static void drop_caches(void)
+{
+	int fd;
+
+	sync();
+	if (!b.drop_caches)
+		return;
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		die("dropping caches");
+	close(fd);
+}
+
+/* starts the measured part of a workload */
+static unsigned long long begin(void)
+{
+	stats_read(&stats_before);
+	return now_ns();
+}
+
+static void report(const char *workload, const char *params,
+		   unsigned long long start, struct lat *l,
+		   unsigned long long bytes)
+{
+	static const unsigned int pct[] = { 500, 900, 990, 999, 1000 };
+	unsigned long long ns = now_ns() - start, p[5] = { 0 };
+	struct stats after;
+	int i;
+
+	if (l->nr) {
+		qsort(l->v, l->nr, sizeof(*l->v), cmp_ull);
+		for (i = 0; i < 5; i++)
+			p[i] = l->v[(l->nr - 1) * pct[i] / 1000];
+	}
+	printf("workload=%s %s ops=%zu bytes=%llu ns=%llu ops_per_s=%llu "
+	       "bytes_per_s=%llu p50_ns=%llu p90_ns=%llu p99_ns=%llu "
+	       "p999_ns=%llu max_ns=%llu",
+	       workload, params, l->nr, bytes, ns,
+	       (unsigned long long)(l->nr * 1e9 / (ns ? ns : 1)),
+	       (unsigned long long)(bytes * 1e9 / (ns ? ns : 1)),
+	       p[0], p[1], p[2], p[3], p[4]);
+
+	stats_read(&after);
+	for (i = 0; i < after.nr && i < stats_before.nr; i++)
+		if (after.v[i] != stats_before.v[i])
+			printf(" fs_%s=%llu", after.name[i],
+			       after.v[i] - stats_before.v[i]);
+	printf("\n");
+	fflush(stdout);
+	l->nr = 0;
+}
+
+static char *path(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static char *path(const char *fmt, ...)
+{
+	static char p[4096];
+	char name[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+	snprintf(p, sizeof(p), "%s/%s", b.dir, name);
+	return p;
+}
+
+static void seq_write(unsigned long long bs)
+{
+	struct lat l = { 0 };
+	unsigned long long off, start, t;
+	char params[64];
+	int fd;
+
+	fd = open(path("data"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die("creating data file");
+	snprintf(params, sizeof(params), "bs=%llu", bs);
+	start = begin();
+	for (off = 0; off < b.file_size; off += bs) {
+		t = now_ns();
+		if (pwrite(fd, buf, bs, off) != (ssize_t)bs)
+			die("write");
+		lat_add(&l, now_ns() - t);
+	}
+	if (fsync(fd))
+		die("fsync");
+	report("seqwrite", params, start, &l, b.file_size);
+	close(fd);
+	free(l.v);
+}
+
+static void seq_read(unsigned long long bs)
+{
+	struct lat l = { 0 };
+	unsigned long long off, start, t;
+	char params[64];
+	int fd;
+
+	drop_caches();
+	fd = open(path("data"), O_RDONLY);
+	if (fd < 0)
+		die("opening data file");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	snprintf(params, sizeof(params), "bs=%llu", bs);
+	start = begin();
+	for (off = 0; off < b.file_size; off += bs) {
+		t = now_ns();
+		if (pread(fd, buf, bs, off) != (ssize_t)bs)
+			die("read");
+		lat_add(&l, now_ns() - t);
+	}
+	report("seqread", params, start, &l, b.file_size);
+	close(fd);
+	free(l.v);
+}
+
+static void rand_rw(int write)
+{
+	struct lat l = { 0 };
+	unsigned long long start, t, off, blocks = b.file_size >> 12;
+	unsigned int i;
+	ssize_t ret;
+	int fd;
+
+	drop_caches();
+	fd = open(path("data"), write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		die("opening data file");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	/* same offsets on every run */
+	srandom(1);
+	start = begin();
+	for (i = 0; i < b.rand_ops; i++) {
+		off = ((unsigned long long)random() % blocks) << 12;
+		t = now_ns();
+		ret = write ? pwrite(fd, buf, 4096, off) : pread(fd, buf, 4096, off);
+		if (ret != 4096)
+			die(write ? "write" : "read");
+		lat_add(&l, now_ns() - t);
+	}
+	if (write && fsync(fd))
+		die("fsync");
+	report(write ? "randwrite" : "randread", "bs=4096", start, &l,
+	       (unsigned long long)b.rand_ops * 4096);
+	close(fd);
+	free(l.v);
+}
+
+/* dirties the file through a mapping, msync every megabyte */
+static void mmap_write(void)
+{
+	struct lat l = { 0 };
+	unsigned long long off, start, t, chunk = 1 << 20;
+	char *map;
+	int fd;
+
+	fd = open(path("data"), O_RDWR);
+	if (fd < 0)
+		die("opening data file");
+	map = mmap(NULL, b.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	start = begin();
+	for (off = 0; off < b.file_size; off += chunk) {
+		memset(map + off, (int)(off >> 20), chunk);
+		t = now_ns();
+		if (msync(map + off, chunk, MS_SYNC))
+			die("msync");
+		lat_add(&l, now_ns() - t);
+	}
+	report("mmap_msync", "chunk=1048576", start, &l, b.file_size);
+	munmap(map, b.file_size);
+	close(fd);
+	free(l.v);
+}
+
+static void meta_storm(void)
+{
+	struct lat l = { 0 };
+	unsigned long long start, t;
+	char params[64];
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	if (mkdir(path("meta"), 0755))
+		die("mkdir");
+	snprintf(params, sizeof(params), "files=%u", b.files);
+
+	start = begin();
+	for (i = 0; i < b.files; i++) {
+		t = now_ns();
+		fd = open(path("meta/f%u", i), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			die("create");
+		close(fd);
+		lat_add(&l, now_ns() - t);
+	}
+	report("create", params, start, &l, 0);
+
+	drop_caches();
+	start = begin();
+	for (i = 0; i < b.files; i++) {
+		t = now_ns();
+		if (stat(path("meta/f%u", i), &st))
+			die("stat");
+		lat_add(&l, now_ns() - t);
+	}
+	report("stat", params, start, &l, 0);
+
+	start = begin();
+	for (i = 0; i < b.files; i++) {
+		t = now_ns();
+		if (unlink(path("meta/f%u", i)))
+			die("unlink");
+		lat_add(&l, now_ns() - t);
+	}
+	report("unlink", params, start, &l, 0);
+
+	rmdir(path("meta"));
+	free(l.v);
+}
+
+/* lists the directory once cold, once warm and once with stat of all */
+static void readdir_deep(unsigned long long entries)
+{
+	static const char *names[] = { "readdir_cold", "readdir_warm",
+				       "readdir_stat" };
+	struct lat l = { 0 };
+	unsigned long long start, t, i;
+	struct dirent *de;
+	char params[64], dir[4096];
+	struct stat st;
+	DIR *d;
+	int pass, fd;
+
+	snprintf(dir, sizeof(dir), "%s", path("dir%llu", entries));
+	if (mkdir(dir, 0755))
+		die("mkdir");
+	for (i = 0; i < entries; i++) {
+		fd = open(path("dir%llu/entry%llu", entries, i),
+			  O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			die("create");
+		close(fd);
+	}
+	snprintf(params, sizeof(params), "entries=%llu", entries);
+
+	drop_caches();
+	for (pass = 0; pass < 3; pass++) {
+		start = begin();
+		d = opendir(dir);
+		if (!d)
+			die("opendir");
+		t = now_ns();
+		while ((de = readdir(d))) {
+			if (pass == 2 && fstatat(dirfd(d), de->d_name, &st, 0))
+				die("stat");
+			lat_add(&l, now_ns() - t);
+			t = now_ns();
+		}
+		closedir(d);
+		report(names[pass], params, start, &l, 0);
+	}
+
+	for (i = 0; i < entries; i++)
+		unlink(path("dir%llu/entry%llu", entries, i));
+	rmdir(dir);
+	free(l.v);
+}
+
+/*
+ * Every source file looks for its headers in all include directories,
+ * only the last one has them, like a compiler with a long -I list does.
+ */
+static void lookup_build(void)
+{
+	struct lat l = { 0 };
+	unsigned long long start, t;
+	unsigned int d, f, p, hits = 0, misses = 0;
+	char params[64];
+	struct stat st;
+	int fd;
+
+	for (p = 0; p < LOOKUP_PATHS; p++)
+		if (mkdir(path("inc%u", p), 0755))
+			die("mkdir");
+	for (f = 0; f < LOOKUP_FILES; f++) {
+		fd = open(path("inc%u/h%u.h", LOOKUP_PATHS - 1, f),
+			  O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			die("create");
+		close(fd);
+	}
+
+	drop_caches();
+	start = begin();
+	for (d = 0; d < LOOKUP_DIRS; d++)
+		for (f = 0; f < LOOKUP_FILES; f++)
+			for (p = 0; p < LOOKUP_PATHS; p++) {
+				t = now_ns();
+				if (stat(path("inc%u/h%u.h", p, (d + f) %
+					      LOOKUP_FILES), &st) == 0) {
+					hits++;
+					lat_add(&l, now_ns() - t);
+					break;
+				}
+				if (errno != ENOENT)
+					die("stat");
+				misses++;
+				lat_add(&l, now_ns() - t);
+			}
+	snprintf(params, sizeof(params), "hits=%u misses=%u", hits, misses);
+	report("lookup", params, start, &l, 0);
+
+	for (f = 0; f < LOOKUP_FILES; f++)
+		unlink(path("inc%u/h%u.h", LOOKUP_PATHS - 1, f));
+	for (p = 0; p < LOOKUP_PATHS; p++)
+		rmdir(path("inc%u", p));
+	free(l.v);
+}
+
+static int parse_list(struct list *l, char *s)
+{
+	char *tok, *end;
+
+	l->nr = 0;
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		unsigned long long v = strtoull(tok, &end, 0);
+
+		if (*end == 'k' || *end == 'K')
+			v <<= 10, end++;
+		else if (*end == 'm' || *end == 'M')
+			v <<= 20, end++;
+		if (*end || end == tok || !v || l->nr == MAX_LIST)
+			return -1;
+		l->v[l->nr++] = v;
+	}
+	return l->nr ? 0 : -1;
+}
+
+static int selected(const char *w)
+{
+	const char *p = b.workloads;
+	size_t len = strlen(w);
+
+	if (!p)
+		return 1;
+	while ((p = strstr(p, w))) {
+		if ((p == b.workloads || p[-1] == ',') &&
+		    (p[len] == ',' || !p[len]))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+/* the options the kernel reports, including defaults not given to mount */
+static void print_mount(const char *dir)
+{
+	char line[4096], dev[1024], type[64], opts[2048];
+	char real[4096];
+	size_t len, best = 0;
+	FILE *f;
+
+	if (!realpath(dir, real))
+		die(dir);
+	f = fopen("/proc/mounts", "r");
+	if (!f)
+		die("/proc/mounts");
+	dev[0] = type[0] = opts[0] = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char d[1024], m[1024], t[64], o[2048];
+
+		if (sscanf(line, "%1023s %1023s %63s %2047s", d, m, t, o) != 4)
+			continue;
+		/* the last and longest mount point containing the directory */
+		len = strlen(m);
+		if (strncmp(real, m, len) || len < best ||
+		    (real[len] && real[len] != '/' && len > 1))
+			continue;
+		best = len;
+		strcpy(dev, d);
+		strcpy(type, t);
+		strcpy(opts, o);
+	}
+	fclose(f);
+	printf("bench=prlfs dir=%s source=%s fstype=%s options=%s "
+	       "file_size=%llu rand_ops=%u files=%u drop_caches=%d\n",
+	       real, dev, type, opts, b.file_size, b.rand_ops, b.files,
+	       b.drop_caches);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: prlfs_bench [options] DIR\n"
+		"  -s SF      mount shared folder SF on DIR first, unmount after\n"
+		"  -o OPTS    prl_fs mount options for -s, e.g. ttl=100,qdepth=8\n"
+		"  -w LIST    workloads: seqwrite,seqread,randwrite,randread,\n"
+		"             mmap,meta,readdir,lookup, default all\n"
+		"  -f SIZE    data file size, k and m suffixes, default 256m\n"
+		"  -b LIST    sequential block sizes, default 4k,64k,1m\n"
+		"  -n N       random operations, default 10000\n"
+		"  -N N       files of the metadata storm, default 10000\n"
+		"  -D LIST    entries of the read directories, default 10000,100000\n"
+		"  -C         drop the page cache before read workloads (root)\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static char bs_def[] = "4k,64k,1m", dirs_def[] = "10000,100000";
+	const char *sf = NULL, *opts = "";
+	unsigned long long max_bs = 4096;
+	struct list size;
+	char *dir, *end;
+	int opt, i;
+
+	parse_list(&b.bs, bs_def);
+	parse_list(&b.dirs, dirs_def);
+	while ((opt = getopt(argc, argv, "s:o:w:f:b:n:N:D:C")) != -1) {
+		switch (opt) {
+		case 's':
+			sf = optarg;
+			break;
+		case 'o':
+			opts = optarg;
+			break;
+		case 'w':
+			b.workloads = optarg;
+			break;
+		case 'f':
+			if (parse_list(&size, optarg) || size.nr != 1)
+				usage();
+			b.file_size = size.v[0] & ~1048575ULL;
+			if (!b.file_size)
+				usage();
+			break;
+		case 'b':
+			if (parse_list(&b.bs, optarg))
+				usage();
+			break;
+		case 'n':
+			b.rand_ops = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		case 'N':
+			b.files = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		case 'D':
+			if (parse_list(&b.dirs, optarg))
+				usage();
+			break;
+		case 'C':
+			b.drop_caches = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	dir = argv[optind];
+
+	if (sf && mount(sf, dir, "prl_fs", 0, opts))
+		die("mount");
+	print_mount(dir);
+
+	for (i = 0; i < b.bs.nr; i++) {
+		if (b.bs.v[i] > b.file_size || b.file_size % b.bs.v[i])
+			usage();
+		if (b.bs.v[i] > max_bs)
+			max_bs = b.bs.v[i];
+	}
+	if (posix_memalign((void **)&buf, 4096, max_bs))
+		die("malloc");
+	memset(buf, 0x5a, max_bs);
+
+	if (asprintf(&b.dir, "%s/prlfs_bench.%d", dir, getpid()) < 0)
+		die("malloc");
+	if (mkdir(b.dir, 0755))
+		die(b.dir);
+
+	/* the data workloads share one file written by the first of them */
+	if (selected("seqwrite") || selected("seqread") ||
+	    selected("randwrite") || selected("randread") || selected("mmap")) {
+		if (selected("seqwrite"))
+			for (i = 0; i < b.bs.nr; i++)
+				seq_write(b.bs.v[i]);
+		else
+			seq_write(max_bs);
+		for (i = 0; selected("seqread") && i < b.bs.nr; i++)
+			seq_read(b.bs.v[i]);
+		if (selected("randread"))
+			rand_rw(0);
+		if (selected("randwrite"))
+			rand_rw(1);
+		if (selected("mmap"))
+			mmap_write();
+		unlink(path("data"));
+	}
+	if (selected("meta"))
+		meta_storm();
+	for (i = 0; selected("readdir") && i < b.dirs.nr; i++)
+		readdir_deep(b.dirs.v[i]);
+	if (selected("lookup"))
+		lookup_build();
+
+	rmdir(b.dir);
+	if (sf && umount(dir))
+		die("umount");
+	return 0;
+}
@@ -11,21 +11,23 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
 
-#define PRLFS_PROC_OPS_INIT(_owner, _open, _read, _lseek, _release) \
+#define PRLFS_PROC_OPS_INIT(_owner, _open, _read, _write, _lseek, _release) \
 	{ \
 		.proc_open = _open, \
 		.proc_read = _read, \
+		.proc_write = _write, \
 		.proc_lseek = _lseek, \
 		.proc_release = _release, \
 	}
 
 #else
 
-#define PRLFS_PROC_OPS_INIT(_owner, _open, _read, _lseek, _release) \
+#define PRLFS_PROC_OPS_INIT(_owner, _open, _read, _write, _lseek, _release) \
 	{ \
 		.owner = _owner, \
 		.open = _open, \
 		.read = _read, \
+		.write = _write, \
 		.llseek = _lseek, \
 		.release = _release, \
 	}
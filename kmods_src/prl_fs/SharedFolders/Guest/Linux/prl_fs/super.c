@@ -15,6 +15,7 @@
 #include <linux/vfs.h>
 #include <linux/backing-dev.h>
 #include <linux/mount.h>
+#include <linux/percpu.h>
 #include "prlfs.h"
 #include "prlfs_compat.h"
 
@@ -24,6 +25,11 @@
 static char version[] = KERN_INFO DRIVER_LOAD_MSG "\n";
 
 static struct pci_dev *pci_tg;
+struct kmem_cache *prlfs_path_cachep;
+
+/* mounted super blocks, their cache counters add up to the global ones */
+static LIST_HEAD(prlfs_sbs);
+static DEFINE_SPINLOCK(prlfs_sbs_lock);
 
 extern struct file_operations prlfs_names_fops;
 extern struct inode_operations prlfs_names_iops;
@@ -64,7 +70,9 @@ prlfs_parse_mount_options(char *options, struct prlfs_sb_info *sbi)
 	DPRINTK("ENTER\n");
 	sbi->uid = current->cred->uid;
 	sbi->gid = current->cred->gid;
-	sbi->ttl = HZ;
+	sbi->attr_ttl = sbi->entry_ttl = sbi->neg_ttl = HZ;
+	sbi->rdsize = PRLFS_RDSIZE_DEFAULT;
+	sbi->qdepth = 1;
 
 	if (!options)
 	       goto out;
@@ -80,8 +88,36 @@ prlfs_parse_mount_options(char *options, struct prlfs_sb_info *sbi)
 			if (strlen(val) == 0)
 				val = NULL;
 		}
-		if (!strcmp(opt, "ttl") && val)
-			ret = prlfs_strtoui(val, &sbi->ttl);
+		if (!strcmp(opt, "ttl") && val) {
+			ret = prlfs_strtoui(val, &sbi->attr_ttl);
+			sbi->entry_ttl = sbi->neg_ttl = sbi->attr_ttl;
+		}
+		else if (!strcmp(opt, "attr_ttl") && val)
+			ret = prlfs_strtoui(val, &sbi->attr_ttl);
+		else if (!strcmp(opt, "entry_ttl") && val)
+			ret = prlfs_strtoui(val, &sbi->entry_ttl);
+		else if (!strcmp(opt, "neg_ttl") && val)
+			ret = prlfs_strtoui(val, &sbi->neg_ttl);
+		else if (!strcmp(opt, "writeback"))
+			sbi->writeback = 1;
+		else if (!strcmp(opt, "rdplus"))
+			sbi->rdplus = 1;
+		else if (!strcmp(opt, "pathcache"))
+			sbi->pathcache = 1;
+		else if (!strcmp(opt, "dirstamp"))
+			sbi->dirstamp = 1;
+		else if (!strcmp(opt, "lazyrelease"))
+			sbi->lazyrelease = 1;
+		else if (!strcmp(opt, "rdsize") && val) {
+			ret = prlfs_strtoui(val, &sbi->rdsize);
+			sbi->rdsize = clamp_t(unsigned, sbi->rdsize,
+					      PAGE_SIZE, PRLFS_RDSIZE_MAX);
+		}
+		else if (!strcmp(opt, "qdepth") && val) {
+			ret = prlfs_strtoui(val, &sbi->qdepth);
+			sbi->qdepth = clamp_t(unsigned, sbi->qdepth,
+					      1, PRLFS_QDEPTH_MAX);
+		}
 		else if (!strcmp(opt, "uid") && val) {
 			uid_t uid_arg = -1;
 			ret = prlfs_strtoui(val, &uid_arg);
@@ -118,7 +154,8 @@ static int prlfs_remount(struct super_block *sb, int *flags, char *data)
 	       ((*flags) & MS_MANDLOCK) )
 			ret = -EINVAL;
 
-	*flags |= MS_SYNCHRONOUS; /* silently don't drop sync flag */
+	if (!PRLFS_SB(sb)->writeback)
+		*flags |= MS_SYNCHRONOUS; /* silently don't drop sync flag */
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
@@ -128,6 +165,10 @@ static void prlfs_put_super(struct super_block *sb)
 	struct prlfs_sb_info *prlfs_sb;
 
 	prlfs_sb = PRLFS_SB(sb);
+	spin_lock(&prlfs_sbs_lock);
+	list_del(&prlfs_sb->sbs);
+	spin_unlock(&prlfs_sbs_lock);
+	prlfs_release_destroy(prlfs_sb);
 	prlfs_bdi_destroy(&prlfs_sb->bdi);
 	kfree(prlfs_sb);
 }
@@ -180,6 +221,7 @@ static void prlfs_evict_inode(struct inode *inode) {
 #else
 	clear_inode(inode);
 #endif
+	prlfs_dir_cache_drop(inode);
 	kfree(inode_get_pfd(inode));
 	inode_set_pfd(inode, NULL);
 }
@@ -193,7 +235,28 @@ int prlfs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
 #endif
 	struct prlfs_sb_info *prlfs_sb = PRLFS_SB(sb);
 
-	seq_printf(seq, ",ttl=%u", prlfs_sb->ttl);
+	/* the split form only when it can not be said with ttl */
+	if (prlfs_sb->attr_ttl == prlfs_sb->entry_ttl &&
+	    prlfs_sb->attr_ttl == prlfs_sb->neg_ttl)
+		seq_printf(seq, ",ttl=%u", prlfs_sb->attr_ttl);
+	else
+		seq_printf(seq, ",attr_ttl=%u,entry_ttl=%u,neg_ttl=%u",
+			   prlfs_sb->attr_ttl, prlfs_sb->entry_ttl,
+			   prlfs_sb->neg_ttl);
+	if (prlfs_sb->writeback)
+		seq_puts(seq, ",writeback");
+	if (prlfs_sb->rdplus)
+		seq_puts(seq, ",rdplus");
+	if (prlfs_sb->pathcache)
+		seq_puts(seq, ",pathcache");
+	if (prlfs_sb->dirstamp)
+		seq_puts(seq, ",dirstamp");
+	if (prlfs_sb->lazyrelease)
+		seq_puts(seq, ",lazyrelease");
+	if (prlfs_sb->rdsize != PRLFS_RDSIZE_DEFAULT)
+		seq_printf(seq, ",rdsize=%u", prlfs_sb->rdsize);
+	if (prlfs_sb->qdepth > 1)
+		seq_printf(seq, ",qdepth=%u", prlfs_sb->qdepth);
 
 	if (prlfs_sb->nls[0])
 		seq_printf(seq, ",nls=%s", prlfs_sb->nls);
@@ -209,6 +272,28 @@ int prlfs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
 	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+static int prlfs_show_stats(struct seq_file *seq, struct dentry *root) {
+	struct super_block *sb = root->d_sb;
+#else
+static int prlfs_show_stats(struct seq_file *seq, struct vfsmount *vfs) {
+	struct super_block *sb = vfs->mnt_sb;
+#endif
+	struct prlfs_cache_stats *st = &PRLFS_SB(sb)->cstats;
+
+	seq_printf(seq, " entry_hit=%ld neg_hit=%ld revalidate=%ld lookup=%ld"
+		   " attr_hit=%ld attr_miss=%ld rdplus=%ld dir_verified=%ld",
+		   atomic_long_read(&st->entry_hit),
+		   atomic_long_read(&st->neg_hit),
+		   atomic_long_read(&st->revalidate),
+		   atomic_long_read(&st->lookup),
+		   atomic_long_read(&st->attr_hit),
+		   atomic_long_read(&st->attr_miss),
+		   atomic_long_read(&st->rdplus),
+		   atomic_long_read(&st->dir_verified));
+	return 0;
+}
+
 struct super_operations prlfs_super_ops = {
 #ifndef PRLFS_IGET
 	.read_inode	= prlfs_read_inode,
@@ -222,6 +307,7 @@ struct super_operations prlfs_super_ops = {
 	.delete_inode	= prlfs_evict_inode,
 #endif
 	.show_options	= prlfs_show_options,
+	.show_stats	= prlfs_show_stats,
 };
 
 struct prlfs_sf_param_req {
@@ -317,6 +403,10 @@ static int prlfs_bdi_init_and_register(struct super_block *sb, struct prlfs_sb_i
 		goto out;
 
 	ret = prlfs_bdi_register(sb, &prlfs_sb->bdi, prlfs_sb->sfid, sb->s_dev);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+	if (!ret)
+		sb->s_bdi->ra_pages = PRLFS_RA_MAX_PAGES;
+#endif
 out:
 	return ret;
 }
@@ -331,7 +421,7 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_blocksize = PAGE_SIZE;
 	sb->s_blocksize_bits = PAGE_SHIFT;
-	sb->s_flags |= MS_NOATIME | MS_SYNCHRONOUS;
+	sb->s_flags |= MS_NOATIME;
 	sb->s_magic = PRLFS_MAGIC;
 	sb->s_op = &prlfs_super_ops;
 
@@ -342,10 +432,20 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 	memset(prlfs_sb, 0, sizeof(struct prlfs_sb_info));
+	init_waitqueue_head(&prlfs_sb->aio_wait);
+	atomic_set(&prlfs_sb->rename_gen, 0);
+	prlfs_release_init(prlfs_sb);
 	prlfs_sb->pdev = pci_get_drvdata(pci_tg);
 	ret = prlfs_parse_mount_options(data, prlfs_sb);
 	if (ret < 0)
 		goto out_free;
+	prlfs_sb->prefix_len = snprintf(prlfs_sb->prefix,
+		sizeof(prlfs_sb->prefix), "/%.*s",
+		(int)strnlen(prlfs_sb->name, sizeof(prlfs_sb->name)),
+		prlfs_sb->name);
+	/* writeback mode leaves flushing to close, fsync and writeback */
+	if (!prlfs_sb->writeback)
+		sb->s_flags |= MS_SYNCHRONOUS;
 
 	if (prlfs_sb->host_inodes) {
 		struct prlfs_sf_features sff = {PRLFS_SFF_HOST_INODES};
@@ -376,6 +476,9 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 		ret = -ENOMEM;
 		goto out_iput;
 	}
+	spin_lock(&prlfs_sbs_lock);
+	list_add_tail(&prlfs_sb->sbs, &prlfs_sbs);
+	spin_unlock(&prlfs_sbs_lock);
 out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
@@ -454,9 +557,12 @@ static struct file_system_type prl_fs_type = {
 	.mount		= prlfs_mount,
 #endif
 	.kill_sb	= kill_anon_super,
-	/*  .fs_flags */
+	/* prlfs_rename() moves the dentry before invalidating cached paths */
+	.fs_flags	= FS_RENAME_DOES_D_MOVE,
 };
 
+DEFINE_PER_CPU(struct prlfs_op_stats, prlfs_op_stats);
+
 #ifdef CONFIG_PROC_FS
 static struct proc_dir_entry *proc_prlfs;
 static void *seq_sf_start(struct seq_file *s, loff_t *pos)
@@ -569,9 +675,113 @@ static struct proc_ops proc_sf_operations = PRLFS_PROC_OPS_INIT(
 		THIS_MODULE,
 		proc_sf_open,
 		seq_read,
+		NULL,
 		seq_lseek,
 		seq_release);
 
+#define PRLFS_OP_STAT(name) { #name, offsetof(struct prlfs_op_stats, name), 0 }
+#define PRLFS_CACHE_STAT(name) \
+	{ #name, offsetof(struct prlfs_cache_stats, name), 1 }
+
+static const struct {
+	const char *name;
+	size_t off;
+	int cache;	/* summed over the mounts instead of the CPUs */
+} prlfs_op_stat_names[] = {
+	PRLFS_CACHE_STAT(lookup),
+	PRLFS_OP_STAT(create),
+	PRLFS_OP_STAT(mkdir),
+	PRLFS_OP_STAT(symlink),
+	PRLFS_OP_STAT(unlink),
+	PRLFS_OP_STAT(rmdir),
+	PRLFS_OP_STAT(rename),
+	PRLFS_OP_STAT(getattr),
+	PRLFS_OP_STAT(setattr),
+	PRLFS_OP_STAT(readlink),
+	PRLFS_OP_STAT(open),
+	PRLFS_OP_STAT(release),
+	PRLFS_OP_STAT(fsync),
+	PRLFS_OP_STAT(readdir),
+	PRLFS_OP_STAT(readpage),
+	PRLFS_OP_STAT(readahead),
+	PRLFS_OP_STAT(writepage),
+	PRLFS_OP_STAT(writepages),
+	PRLFS_OP_STAT(direct_io),
+	PRLFS_OP_STAT(fallocate),
+	PRLFS_OP_STAT(copy_range),
+	PRLFS_CACHE_STAT(entry_hit),
+	PRLFS_CACHE_STAT(neg_hit),
+	PRLFS_CACHE_STAT(revalidate),
+	PRLFS_CACHE_STAT(attr_hit),
+	PRLFS_CACHE_STAT(attr_miss),
+	PRLFS_CACHE_STAT(rdplus),
+	PRLFS_CACHE_STAT(dir_verified),
+	PRLFS_OP_STAT(dir_hit),
+	PRLFS_OP_STAT(dir_miss),
+	PRLFS_OP_STAT(data_hit),
+	PRLFS_OP_STAT(data_miss),
+};
+
+static atomic_long_t *prlfs_cache_stat(struct prlfs_sb_info *sbi, int i)
+{
+	return (atomic_long_t *)((char *)&sbi->cstats +
+				 prlfs_op_stat_names[i].off);
+}
+
+static int seq_stats_show(struct seq_file *s, void *v)
+{
+	struct prlfs_sb_info *sbi;
+	unsigned long n;
+	int i, cpu;
+
+	for (i = 0; i < ARRAY_SIZE(prlfs_op_stat_names); i++) {
+		n = 0;
+		if (prlfs_op_stat_names[i].cache) {
+			spin_lock(&prlfs_sbs_lock);
+			list_for_each_entry(sbi, &prlfs_sbs, sbs)
+				n += atomic_long_read(prlfs_cache_stat(sbi, i));
+			spin_unlock(&prlfs_sbs_lock);
+		} else
+			for_each_possible_cpu(cpu)
+				n += *(unsigned long *)((char *)&per_cpu(prlfs_op_stats, cpu) +
+							prlfs_op_stat_names[i].off);
+		seq_printf(s, "%s: %lu\n", prlfs_op_stat_names[i].name, n);
+	}
+	return 0;
+}
+
+static int proc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, seq_stats_show, NULL);
+}
+
+/* any write starts the counters over */
+static ssize_t proc_stats_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct prlfs_sb_info *sbi;
+	int i, cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(prlfs_op_stats, cpu), 0,
+		       sizeof(struct prlfs_op_stats));
+	spin_lock(&prlfs_sbs_lock);
+	list_for_each_entry(sbi, &prlfs_sbs, sbs)
+		for (i = 0; i < ARRAY_SIZE(prlfs_op_stat_names); i++)
+			if (prlfs_op_stat_names[i].cache)
+				atomic_long_set(prlfs_cache_stat(sbi, i), 0);
+	spin_unlock(&prlfs_sbs_lock);
+	return count;
+}
+
+static struct proc_ops proc_stats_operations = PRLFS_PROC_OPS_INIT(
+		THIS_MODULE,
+		proc_stats_open,
+		seq_read,
+		proc_stats_write,
+		seq_lseek,
+		single_release);
+
 static int prlfs_proc_init(void)
 {
 	int ret = 0;
@@ -585,17 +795,26 @@ static int prlfs_proc_init(void)
 
 	p = prlfs_proc_create("sf_list", S_IFREG | S_IRUGO, proc_prlfs,
 		&proc_sf_operations);
+	if (p == NULL)
+		goto out_dir;
+
+	p = prlfs_proc_create("stats", S_IFREG | S_IRUGO | S_IWUSR, proc_prlfs,
+		&proc_stats_operations);
 	if (p == NULL) {
-		remove_proc_entry("fs/prl_fs", NULL);
-		ret = -ENOMEM;
-		goto out;
+		remove_proc_entry("sf_list", proc_prlfs);
+		goto out_dir;
 	}
 out:
 	return ret;
+
+out_dir:
+	remove_proc_entry("fs/prl_fs", NULL);
+	return -ENOMEM;
 }
 
 static void prlfs_proc_clean(void)
 {
+	remove_proc_entry("stats", proc_prlfs);
 	remove_proc_entry("sf_list", proc_prlfs);
 	remove_proc_entry("fs/prl_fs", NULL);
 }
@@ -623,9 +842,16 @@ static int __init init_prlfs(void)
 	}
 	pci_dev_get(pci_tg);
 
+	prlfs_path_cachep = kmem_cache_create("prlfs_path", PATH_MAX, 0,
+					      0, NULL);
+	if (prlfs_path_cachep == NULL) {
+		ret = -ENOMEM;
+		goto out_dev_put;
+	}
+
 	ret = prlfs_proc_init();
 	if (ret < 0)
-		goto out_dev_put;
+		goto out_cache;
 
 	ret = register_filesystem(&prl_fs_type);
 	if (ret < 0)
@@ -633,6 +859,8 @@ static int __init init_prlfs(void)
 	else
 		goto out;
 
+out_cache:
+	kmem_cache_destroy(prlfs_path_cachep);
 out_dev_put:
 	pci_dev_put(pci_tg);
 out:
@@ -646,6 +874,7 @@ static void __exit exit_prlfs(void)
 	printk(KERN_INFO "unloading " MODNAME "\n");
 	unregister_filesystem(&prl_fs_type);
 	prlfs_proc_clean();
+	kmem_cache_destroy(prlfs_path_cachep);
 	pci_dev_put(pci_tg);
 	DPRINTK("EXIT\n");
 }
@@ -21,6 +21,10 @@
 #include <linux/workqueue.h>
 #include <linux/namei.h>
 #include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/time.h>
+#include <linux/ktime.h>
 #include <asm/uaccess.h>
 #include "prlfs_freeze_compat.h"
 
@@ -35,6 +39,7 @@
  * "-<path>"	thaw
  * "t<seconds>" arm thaw timeout timer
  * "#"		thaw all and stop timeout timer
+ * "b"		freeze paths of the following lines of this write as one batch
  *
  * examples:
  *   # echo 't15	> /proc/driver/prl_freeze
@@ -42,16 +47,52 @@
  *   # echo '/'		> /proc/driver/prl_freeze
  *   arm thaw timeout to 15 seconds, freeze / and /mnt
  *
+ *   # printf 'b\n/\n/mnt\n' > /proc/driver/prl_freeze
+ *   sync / and /mnt in parallel, then freeze /mnt and / back-to-back
+ *
  *   # cat /proc/driver/prl_freeze
- *   shows names of forzen block devices
+ *   shows names of forzen block devices, followed by
+ *   "#<name> sync_us=<us> freeze_us=<us> thaw_us=<us>" lines of the devices
+ *   frozen and thawed since nothing was frozen last time
  *
- * submounts must be frozen _before_ parent mount.
+ * submounts must be frozen _before_ parent mount, a batch orders them
+ * itself by the nesting of their mounts. All are thawed in parallel.
  *
  */
 
+static int path_depth(const char *path)
+{
+	int depth = 0;
+
+	for (; *path; path++)
+		if (*path == '/' && path[1] && path[1] != '/')
+			depth++;
+	return depth;
+}
+
+/*
+ * Nesting of the mount path is on, as the depth of its mount point: a
+ * submount is always mounted below the root of its parent.
+ */
+static int mount_depth(struct path *path)
+{
+	struct path root = { .mnt = path->mnt, .dentry = path->mnt->mnt_root };
+	char *buf, *p;
+	int depth = 0;
+
+	buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!buf)
+		return 0;
+	p = d_path(&root, buf, PATH_MAX);
+	if (!IS_ERR(p))
+		depth = path_depth(p);
+	kfree(buf);
+	return depth;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
 
-struct inode *lookup_target(char *pathname)
+struct inode *lookup_target(char *pathname, int *depth)
 {
 	struct path path;
 	struct inode *inode;
@@ -63,13 +104,15 @@ struct inode *lookup_target(char *pathname)
 	inode = path.dentry->d_inode;
 	if (inode)
 		inode = igrab(inode);
+	if (depth)
+		*depth = mount_depth(&path);
 	path_put(&path);
 	return inode;
 }
 
 #else
 
-struct inode *lookup_target(char *path)
+struct inode *lookup_target(char *path, int *depth)
 {
 	struct nameidata nd;
 	struct inode *inode;
@@ -81,6 +124,8 @@ struct inode *lookup_target(char *path)
 	inode = nd.path.dentry->d_inode;
 	if (inode)
 		inode = igrab(inode);
+	if (depth)
+		*depth = mount_depth(&nd.path);
 	path_put(&nd.path);
 	return inode;
 }
@@ -89,14 +134,103 @@ struct inode *lookup_target(char *path)
 
 struct frozen_sb {
 	struct list_head list;
+	struct hlist_node hash;
 	struct super_block *sb;
+	char name[BDEVNAME_SIZE];
+	u64 sync_us;
+	u64 freeze_us;
+	u64 thaw_us;
+	/* used while a batch is synced, frozen or thawed */
+	struct work_struct work;
+	struct inode *inode;
+	int depth;
 };
 
+/* frozen sbs in freeze order, then the thawed ones kept for their timings */
 LIST_HEAD(frozen_sb);
+LIST_HEAD(thawed_sb);
+
+#define FROZEN_HASH_BITS	6
+static struct hlist_head frozen_hash[1 << FROZEN_HASH_BITS];
+
+/* most of a batch of paths in one write */
+#define FREEZE_WRITE_MAX	(16 * PATH_MAX)
 
 # include <linux/mutex.h>
 DEFINE_MUTEX(frozen_mutex);
 
+static struct frozen_sb *find_frozen(struct super_block *sb)
+{
+	struct hlist_head *head = &frozen_hash[hash_ptr(sb, FROZEN_HASH_BITS)];
+	struct frozen_sb *fsb;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0)
+	struct hlist_node *node;
+
+	hlist_for_each_entry(fsb, node, head, hash)
+#else
+	hlist_for_each_entry(fsb, head, hash)
+#endif
+		if (fsb->sb == sb)
+			return fsb;
+	return NULL;
+}
+
+/* a new freeze cycle starts, timings of the last one are dropped */
+static void free_thawed(void)
+{
+	struct frozen_sb *fsb, *tmp;
+
+	list_for_each_entry_safe(fsb, tmp, &thawed_sb, list)
+		kfree(fsb);
+	INIT_LIST_HEAD(&thawed_sb);
+}
+
+static struct frozen_sb *alloc_frozen(struct super_block *sb)
+{
+	struct frozen_sb *fsb;
+
+	fsb = kzalloc(sizeof(struct frozen_sb), GFP_KERNEL);
+	if (!fsb)
+		return NULL;
+	fsb->sb = sb;
+	if (sb->s_bdev)
+		bdevname(sb->s_bdev, fsb->name);
+	return fsb;
+}
+
+static int do_freeze(struct frozen_sb *fsb)
+{
+	u64 start = prl_clock_us();
+	int ret;
+
+	ret = prl_freeze_bdev(fsb->sb->s_bdev);
+	fsb->freeze_us = prl_clock_us() - start;
+	if (ret)
+		return ret;
+
+	if (list_empty(&frozen_sb))
+		free_thawed();
+	list_add_tail(&fsb->list, &frozen_sb);
+	hlist_add_head(&fsb->hash,
+		       &frozen_hash[hash_ptr(fsb->sb, FROZEN_HASH_BITS)]);
+	return 0;
+}
+
+static void do_thaw(struct frozen_sb *fsb)
+{
+	u64 start = prl_clock_us();
+
+	prl_thaw_bdev(fsb->sb->s_bdev, fsb->sb);
+	fsb->thaw_us = prl_clock_us() - start;
+}
+
+/* the sb is not frozen anymore, only its timings are kept */
+static void unlist_frozen(struct frozen_sb *fsb)
+{
+	hlist_del(&fsb->hash);
+	list_move_tail(&fsb->list, &thawed_sb);
+}
+
 int freeze_sb(struct super_block *sb)
 {
 	struct frozen_sb *fsb;
@@ -105,38 +239,29 @@ int freeze_sb(struct super_block *sb)
 	if (!sb)
 		return -EINVAL;
 
-	list_for_each_entry(fsb, &frozen_sb, list)
-		if (fsb->sb == sb)
-			return -EEXIST;
+	if (find_frozen(sb))
+		return -EEXIST;
 
-	fsb = kmalloc(sizeof(struct frozen_sb), GFP_KERNEL);
+	fsb = alloc_frozen(sb);
 	if (!fsb)
 		return -ENOMEM;
 
-	ret = prl_freeze_bdev(sb->s_bdev);
-	if (ret) {
+	ret = do_freeze(fsb);
+	if (ret)
 		kfree(fsb);
-		return ret;
-	}
-
-	fsb->sb = sb;
-	list_add_tail(&fsb->list, &frozen_sb);
-	return 0;
+	return ret;
 }
 
 int thaw_sb(struct super_block *sb)
 {
 	struct frozen_sb *fsb;
 
-	list_for_each_entry(fsb, &frozen_sb, list) {
-		if (fsb->sb != sb)
-			continue;
-		prl_thaw_bdev(fsb->sb->s_bdev, fsb->sb);
-		list_del(&fsb->list);
-		kfree(fsb);
-		return 0;
-	}
-	return -ENOENT;
+	fsb = find_frozen(sb);
+	if (!fsb)
+		return -ENOENT;
+	do_thaw(fsb);
+	unlist_frozen(fsb);
+	return 0;
 }
 
 int process_path(char *path, int freeze)
@@ -144,7 +269,7 @@ int process_path(char *path, int freeze)
 	struct inode *inode;
 	int ret;
 
-	inode = lookup_target(path);
+	inode = lookup_target(path, NULL);
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
@@ -160,21 +285,148 @@ int process_path(char *path, int freeze)
 	return ret;
 }
 
+static void thaw_work_fn(struct work_struct *work)
+{
+	do_thaw(container_of(work, struct frozen_sb, work));
+}
+
 int thaw_all(void)
 {
 	struct frozen_sb *fsb, *tmp;
 
 	mutex_lock(&frozen_mutex);
+	list_for_each_entry(fsb, &frozen_sb, list) {
+		INIT_WORK(&fsb->work, thaw_work_fn);
+		schedule_work(&fsb->work);
+	}
 	list_for_each_entry_safe(fsb, tmp, &frozen_sb, list) {
-		prl_thaw_bdev(fsb->sb->s_bdev, fsb->sb);
-		kfree(fsb);
+		flush_work(&fsb->work);
+		unlist_frozen(fsb);
 	}
-	INIT_LIST_HEAD(&frozen_sb);
 	mutex_unlock(&frozen_mutex);
 
 	return 0;
 }
 
+/*
+ * Writes back dirty data while the filesystems are still in use, so the
+ * sync done by the freeze itself has little left to do.
+ */
+static void sync_work_fn(struct work_struct *work)
+{
+	struct frozen_sb *fsb = container_of(work, struct frozen_sb, work);
+	u64 start = prl_clock_us();
+
+	down_read(&fsb->sb->s_umount);
+	prl_sync_filesystem(fsb->sb);
+	up_read(&fsb->sb->s_umount);
+	fsb->sync_us = prl_clock_us() - start;
+}
+
+/* submounts are deeper than their parents and go first */
+static int cmp_depth(const void *a, const void *b)
+{
+	const struct frozen_sb *x = *(struct frozen_sb * const *)a;
+	const struct frozen_sb *y = *(struct frozen_sb * const *)b;
+
+	return y->depth - x->depth;
+}
+
+/* "<path>\n<path>..." of the "b" command, paths may start with '+' */
+int freeze_batch(char *list)
+{
+	struct frozen_sb **batch, *fsb;
+	struct inode *inode;
+	char *ptr, *sep;
+	int i, j, nr = 0, max = 1, frozen = 0, depth, ret = 0;
+
+	for (ptr = list; ptr && *ptr; ptr++)
+		if (*ptr == '\n')
+			max++;
+	batch = kcalloc(max, sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (ptr = list; ptr; ptr = sep ? sep + 1 : NULL) {
+		sep = strchr(ptr, '\n');
+		if (sep)
+			*sep = 0;
+		if (ptr[0] == '+')
+			ptr++;
+		if (ptr[0] == '\0')
+			continue;
+		if (ptr[0] != '/') {
+			ret = -EINVAL;
+			goto out;
+		}
+		inode = lookup_target(ptr, &depth);
+		if (IS_ERR(inode)) {
+			ret = PTR_ERR(inode);
+			goto out;
+		}
+		for (i = 0; i < nr; i++)
+			if (batch[i]->sb == inode->i_sb)
+				break;
+		if (i < nr) {
+			/* the same filesystem twice, goes before both parents */
+			if (depth > batch[i]->depth)
+				batch[i]->depth = depth;
+			iput(inode);
+			continue;
+		}
+		fsb = alloc_frozen(inode->i_sb);
+		if (!fsb) {
+			iput(inode);
+			ret = -ENOMEM;
+			goto out;
+		}
+		fsb->inode = inode;
+		fsb->depth = depth;
+		batch[nr++] = fsb;
+	}
+
+	mutex_lock(&frozen_mutex);
+	for (i = 0; i < nr; i++)
+		if (find_frozen(batch[i]->sb)) {
+			ret = -EEXIST;
+			goto out_unlock;
+		}
+
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&batch[i]->work, sync_work_fn);
+		schedule_work(&batch[i]->work);
+	}
+	for (i = 0; i < nr; i++)
+		flush_work(&batch[i]->work);
+
+	sort(batch, nr, sizeof(*batch), cmp_depth, NULL);
+	for (frozen = 0; frozen < nr; frozen++) {
+		ret = do_freeze(batch[frozen]);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		/* parents first, in the reverse order */
+		for (j = frozen - 1; j >= 0; j--) {
+			do_thaw(batch[j]);
+			hlist_del(&batch[j]->hash);
+			list_del(&batch[j]->list);
+		}
+		frozen = 0;
+	}
+out_unlock:
+	mutex_unlock(&frozen_mutex);
+out:
+	for (i = 0; i < nr; i++) {
+		iput(batch[i]->inode);
+		batch[i]->inode = NULL;
+		if (i >= frozen)
+			kfree(batch[i]);
+	}
+	kfree(batch);
+	return ret;
+}
+
 void thaw_timeout(struct work_struct *work)
 {
 	thaw_all();
@@ -237,7 +489,7 @@ ssize_t freeze_write(struct file *file, const char __user *userbuf,
 	char *buf, *ptr, *sep;
 	int ret;
 
-	if (count >= PATH_MAX)
+	if (count >= FREEZE_WRITE_MAX)
 		return -ENAMETOOLONG;
 
 	buf = kmalloc(count+1, GFP_KERNEL);
@@ -277,6 +529,12 @@ ssize_t freeze_write(struct file *file, const char __user *userbuf,
 			case 't':
 				ret = arm_timeout(ptr+1);
 				break;
+			case 'b':
+				/* the rest of the write is the batch */
+				ret = ptr[1] ? -EINVAL :
+					freeze_batch(sep ? sep + 1 : NULL);
+				sep = NULL;
+				break;
 			case '\0':
 				ret = 0;
 				break;
@@ -297,52 +555,26 @@ out:
 	return ret;
 }
 
-static void *seq_start(struct seq_file *file, loff_t *pos)
-{
-	loff_t off = *pos;
-	struct list_head *lh;
-
-	mutex_lock(&frozen_mutex);
-	list_for_each(lh, &frozen_sb)
-		if (!off--)
-			return lh;
-	return NULL;
-}
-
-static void *seq_next(struct seq_file *file, void *data, loff_t *pos)
-{
-	struct list_head *lh = data;
-
-	++*pos;
-	return (lh->next == &frozen_sb) ? NULL : lh->next;
-}
-
-static void seq_stop(struct seq_file *file, void *data)
-{
-	mutex_unlock(&frozen_mutex);
-}
-
 int seq_show(struct seq_file *file, void *data)
 {
 	struct frozen_sb *fsb;
-	char buf[BDEVNAME_SIZE];
 
-	fsb = list_entry((struct list_head*)data, struct frozen_sb, list);
-	bdevname(fsb->sb->s_bdev, buf);
-	seq_printf(file, "%s\n", buf);
+	mutex_lock(&frozen_mutex);
+	list_for_each_entry(fsb, &frozen_sb, list)
+		seq_printf(file, "%s\n", fsb->name);
+	list_for_each_entry(fsb, &frozen_sb, list)
+		seq_printf(file, "#%s sync_us=%llu freeze_us=%llu thaw_us=%llu\n",
+			   fsb->name, fsb->sync_us, fsb->freeze_us, fsb->thaw_us);
+	list_for_each_entry(fsb, &thawed_sb, list)
+		seq_printf(file, "#%s sync_us=%llu freeze_us=%llu thaw_us=%llu\n",
+			   fsb->name, fsb->sync_us, fsb->freeze_us, fsb->thaw_us);
+	mutex_unlock(&frozen_mutex);
 	return 0;
 }
 
-static struct seq_operations freeze_seq_ops = {
-	.start	= seq_start,
-	.next	= seq_next,
-	.stop	= seq_stop,
-	.show	= seq_show,
-};
-
 int freeze_open(struct inode *inode, struct file *file)
 {
-	return seq_open(file, &freeze_seq_ops);
+	return single_open(file, seq_show, NULL);
 }
 
 static struct proc_ops freeze_ops = PRLFS_FREEZE_PROC_OPS_INIT(
@@ -351,7 +583,7 @@ static struct proc_ops freeze_ops = PRLFS_FREEZE_PROC_OPS_INIT(
 		seq_read,
 		freeze_write,
 		seq_lseek,
-		seq_release);
+		single_release);
 
 int __init init_module(void)
 {
@@ -369,6 +601,7 @@ void __exit cleanup_module(void)
 	remove_proc_entry("driver/prl_freeze", NULL);
 	thaw_all();
 	cancel_timeout();
+	free_thawed();
 }
 
 MODULE_AUTHOR ("Parallels International GmbH");
@@ -49,6 +49,25 @@ prlfs_freeze_proc_create(char *name, umode_t mode,
 #endif
 }
 
+/* monotonic us for timings, ktime_get() is GPL only */
+static inline u64 prl_clock_us(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	struct timespec64 ts;
+
+	ktime_get_raw_ts64(&ts);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+	struct timespec64 ts;
+
+	getrawmonotonic64(&ts);
+#else
+	struct timespec ts;
+
+	getrawmonotonic(&ts);
+#endif
+	return (u64)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
 
 #define prl_freeze_bdev(bdev) freeze_bdev(bdev)
@@ -73,4 +92,10 @@ int prl_freeze_bdev(struct block_device *bdev)
 
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
+#define prl_sync_filesystem(sb) sync_filesystem(sb)
+#else
+#define prl_sync_filesystem(sb) fsync_super(sb)
+#endif
+
 #endif
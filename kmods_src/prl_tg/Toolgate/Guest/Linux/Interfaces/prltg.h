@@ -17,6 +17,9 @@ typedef struct _TG_REQ_DESC {
 	 * to be kernelspace
 	 */
 	unsigned kernel_bufs;
+
+	/* buffers registered on the file a user request came from */
+	struct tg_ubuf_set *ubufs;
 } TG_REQ_DESC;
 
 #define prltg_buf_set_kernelspace(sdesc, num) \
@@ -37,6 +40,55 @@ typedef struct _TG_REQ_DESC {
 #define PRL_TG_FILE		PROC_PREFIX TOOLGATE_NICK_NAME
 #define PRL_VTG_FILE	PROC_PREFIX VIDEO_TOOLGATE_NICK_NAME
 
+/*
+ * Asynchronous requests to PRL_TG_FILE: TG_IOCTL_SUBMIT queues up to
+ * TG_SUBMIT_MAX requests and returns how many were queued. Completions
+ * are read() from the same file as struct tg_completion records, poll()
+ * reports POLLIN while one is ready. Status, inline data and byte counts
+ * are written back into each request by the read() that returns it, so
+ * requests and their buffers must stay valid until then and read() must
+ * be called by the submitting process. At most TG_SUBMIT_MAX requests
+ * per file may be submitted and not yet read, further ones fail with
+ * EAGAIN.
+ */
+struct tg_submit {
+	unsigned long long reqs;	/* user array of nr request pointers */
+	unsigned int nr;
+	unsigned int pad;
+};
+
+struct tg_completion {
+	unsigned long long req;		/* request pointer as submitted */
+	int ret;			/* 0 or negative errno */
+	unsigned int status;		/* TG_STATUS_* of the request */
+};
+
+#define TG_SUBMIT_MAX				64
+#define TG_IOCTL_SUBMIT				_IOW ('|',16, struct tg_submit)
+
+/*
+ * TG_IOCTL_REGISTER pins and maps a user buffer for the lifetime of the
+ * file or until TG_IOCTL_UNREGISTER with the returned id. Request buffers
+ * lying within it are then passed to the host without pinning them again.
+ * The pages count against RLIMIT_MEMLOCK of the user, registering fails
+ * with ENOMEM above it, or with EPERM without CAP_IPC_LOCK on kernels
+ * that can not account them. Only requests of the registering process
+ * use the buffer. It must stay mapped while registered, a range mapped
+ * anew at the same address is not seen.
+ */
+struct tg_ubuf_reg {
+	unsigned long long va;
+	unsigned int len;		/* up to TG_UBUF_MAX_LEN */
+	unsigned int writable;		/* host may write to the buffer */
+	unsigned int id;		/* out */
+	unsigned int pad;
+};
+
+#define TG_UBUF_MAX				16
+#define TG_UBUF_MAX_LEN				(64 << 20)
+#define TG_IOCTL_REGISTER			_IOWR('|',17, struct tg_ubuf_reg)
+#define TG_IOCTL_UNREGISTER			_IOW ('|',18, unsigned int)
+
 struct draw_bdesc {
 	union {
 		void *pbuf;
@@ -9,5 +9,9 @@ extern int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc);
 extern struct TG_PENDING_REQUEST *call_tg_async_start(struct tg_dev *dev, TG_REQ_DESC *sdesc);
 extern void call_tg_async_wait(struct TG_PENDING_REQUEST *req);
 extern void call_tg_async_cancel(struct TG_PENDING_REQUEST *req);
+/* end_io is called once from process context when the request is done */
+typedef void (*tg_end_io_t)(TG_REQ_DESC *sdesc, void *data);
+extern int call_tg_async_submit(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+				tg_end_io_t end_io, void *data);
 
 #define TOOLGATE_DEV_DEFAULT (struct tg_dev *)0x1234
@@ -8,6 +8,8 @@
 #include <linux/vmalloc.h>
 #include <linux/interrupt.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/poll.h>
 #include <linux/hash.h>
 #include <linux/delay.h>
 #include <linux/version.h>
@@ -50,6 +52,31 @@ static struct pci_device_id prl_tg_pci_tbl[] = {
 };
 MODULE_DEVICE_TABLE (pci, prl_tg_pci_tbl);
 
+unsigned int tg_poll_us;
+module_param_named(poll_us, tg_poll_us, uint, 0644);
+MODULE_PARM_DESC(poll_us, "Spin up to this many microseconds for a request "
+		 "to complete before sleeping, 0 disables polling");
+
+/* moves a finished request to the list, called under the queue lock */
+static void tg_req_reap(struct tg_dev *dev, struct TG_PENDING_REQUEST *req,
+			struct list_head *completed)
+{
+	if (req->dst->Status == TG_STATUS_PENDING)
+		return;
+
+	if (req->dst->Status == TG_STATUS_SUCCESS &&
+		(req->sdesc->flags & TG_REQ_RESTART_ON_SUCCESS)) {
+		req->dst->Status = TG_STATUS_PENDING;
+		tg_out(dev, TG_PORT_SUBMIT, req->phys);
+		return;
+	}
+
+	if (req->slot >= 0)
+		__clear_bit(req->slot, req->q->pending);
+	list_move(&req->pr_list, completed);
+	req->processed = 1;
+}
+
 /* Interrupt's bottom half */
 static void tg_do_work(struct work_struct *work)
 {
@@ -57,76 +84,100 @@ static void tg_do_work(struct work_struct *work)
 	struct list_head *tmp, *n;
 	struct TG_PENDING_REQUEST *req;
 	struct tg_dev *dev = container_of(work, struct tg_dev, work);
-	unsigned long flags;
+	struct tg_queue *q;
+	unsigned int slot;
 
 	DPRINTK("ENTER\n");
 
 	INIT_LIST_HEAD(&completed);
-	spin_lock_irqsave(&dev->queue_lock, flags);
-	list_for_each_safe(tmp, n, &dev->pr_list) {
-		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
-		if (req->dst->Status == TG_STATUS_PENDING)
-			continue;
-
-		if (req->dst->Status == TG_STATUS_SUCCESS &&
-			(req->sdesc->flags & TG_REQ_RESTART_ON_SUCCESS)) {
-			req->dst->Status = TG_STATUS_PENDING;
-			tg_out(dev, TG_PORT_SUBMIT, req->phys);
-			continue;
-		}
-
-		list_move(&req->pr_list, &completed);
-		req->processed = 1;
+	/*
+	 * The host reports completion only in the request status, pooled
+	 * requests are found through the pending bitmap without walking a
+	 * list, only requests larger than a page are kept on pr_list.
+	 */
+	for (q = dev->queues; q < dev->queues + dev->nr_queues; q++) {
+		spin_lock(&q->lock);
+		for_each_set_bit(slot, q->pending, dev->pool.nr)
+			tg_req_reap(dev, dev->pool.req[slot], &completed);
+		list_for_each_safe(tmp, n, &q->pr_list)
+			tg_req_reap(dev, list_entry(tmp, struct TG_PENDING_REQUEST,
+						    pr_list), &completed);
+		spin_unlock(&q->lock);
 	}
-	spin_unlock_irqrestore(&dev->queue_lock, flags);
 
-	/* enable Toolgate's interrupt */
-	if (!(dev->flags & TG_DEV_FLAG_MSI))
+	/* enable Toolgate's interrupt, pollers enable it when they are done */
+	if (!(dev->flags & TG_DEV_FLAG_MSI) && !atomic_read(&dev->poll.active))
 		tg_out32(dev, TG_PORT_MASK, TG_MASK_COMPLETE);
 
 	list_for_each_safe(tmp, n, &completed) {
 		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
-		complete(&req->waiting);
+		if (req->end_io)
+			tg_req_end_io(req);
+		else
+			complete(&req->waiting);
 	}
 
 	DPRINTK("EXIT\n");
 }
 
+static int tg_cancel_done(struct list_head *cancelled)
+{
+	struct TG_PENDING_REQUEST *req;
+
+	list_for_each_entry(req, cancelled, pr_list)
+		if (req->dst->Status == TG_STATUS_PENDING)
+			return 0;
+	return 1;
+}
+
 static void tg_req_cancel_all(struct tg_dev *dev)
 {
 	struct list_head cancelled;
 	struct list_head *tmp, *n;
 	struct TG_PENDING_REQUEST *req;
-	unsigned long flags;
+	struct tg_queue *q;
+	unsigned int slot, nr = 0, leaked = 0, ms;
+	unsigned long start = jiffies, deadline = start + 4 * HZ;
 
 	DPRINTK("ENTER\n");
 
 	INIT_LIST_HEAD(&cancelled);
-	spin_lock_irqsave(&dev->queue_lock, flags);
-	list_for_each_safe(tmp, n, &dev->pr_list) {
-		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
-		if (req->dst->Status == TG_STATUS_PENDING) {
-			list_move(&req->pr_list, &cancelled);
-			req->processed = 1;
+	for (q = dev->queues; q < dev->queues + dev->nr_queues; q++) {
+		spin_lock(&q->lock);
+		for_each_set_bit(slot, q->pending, dev->pool.nr) {
+			req = dev->pool.req[slot];
+			if (req->dst->Status == TG_STATUS_PENDING) {
+				__clear_bit(slot, q->pending);
+				list_add_tail(&req->pr_list, &cancelled);
+				req->processed = 1;
+			}
+		}
+		list_for_each_safe(tmp, n, &q->pr_list) {
+			req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
+			if (req->dst->Status == TG_STATUS_PENDING) {
+				list_move(&req->pr_list, &cancelled);
+				req->processed = 1;
+			}
 		}
+		spin_unlock(&q->lock);
 	}
-	spin_unlock_irqrestore(&dev->queue_lock, flags);
 
+	atomic_set(&dev->cancel.active, 1);
 	list_for_each(tmp, &cancelled) {
 		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
 		tg_out(dev, TG_PORT_CANCEL, req->phys);
+		nr++;
 	}
-	/* waiting host's confirmation up to several seconds */
-	list_for_each_safe(tmp, n, &cancelled) {
-		int timeout = 1;
+	/* waiting host's confirmation of all of them up to several seconds */
+	while (!tg_cancel_done(&cancelled) && time_before(jiffies, deadline))
+		/* the host may cancel without an interrupt, look now and then */
+		wait_event_timeout(dev->cancel.wait, tg_cancel_done(&cancelled),
+				   clamp_t(long, deadline - jiffies, 1, HZ / 10));
+	atomic_set(&dev->cancel.active, 0);
 
+	list_for_each_safe(tmp, n, &cancelled) {
 		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
-		while ((req->dst->Status == TG_STATUS_PENDING) &&
-							(timeout < 4*HZ)) {
-			msleep(timeout);
-			timeout *= 2;
-		}
-		if (req->dst->Status == TG_STATUS_PENDING)
+		if (req->dst->Status == TG_STATUS_PENDING) {
 			/* Host don't cancel request. If we free it we can get
 			 * the memory corruption if host will handle it later.
 			 * If we don't free it, we'll leak the memory if host
@@ -134,10 +185,21 @@ static void tg_req_cancel_all(struct tg_dev *dev)
 			 * better than memory corruption */
 			 printk(KERN_ERR PFX "Host don't handle "
 					"request's cancel %p\n", req);
+			leaked++;
+		} else if (req->end_io)
+			tg_req_end_io(req);
 		else
-		complete(&req->waiting);
+			complete(&req->waiting);
 	}
-	DPRINTK("EXIT\n");
+
+	ms = jiffies_to_msecs(jiffies - start);
+	dev->cancel.runs++;
+	dev->cancel.last_nr = nr;
+	dev->cancel.last_ms = ms;
+	dev->cancel.leaked += leaked;
+	if (ms > dev->cancel.max_ms)
+		dev->cancel.max_ms = ms;
+	DPRINTK("EXIT %u requests in %u ms, %u leaked\n", nr, ms, leaked);
 }
 
 int prl_tg_user_to_host_request_complete(char *u, TG_REQ_DESC *sdesc, int ret)
@@ -245,6 +307,17 @@ err_vm:
 }
 EXPORT_SYMBOL(prl_tg_user_to_host_request_prepare);
 
+/* per open file state of asynchronous requests */
+struct tg_file {
+	struct tg_dev *dev;
+	spinlock_t lock;		/* protects done, inflight and queued */
+	struct list_head done;		/* completed, not yet read */
+	unsigned int inflight;
+	unsigned int queued;		/* submitted, not yet read */
+	wait_queue_head_t wait;
+	struct tg_ubuf_set ubufs;	/* registered buffers */
+};
+
 static ssize_t prl_tg_write(struct file *filp, const char __user *buf,
 	size_t nbytes, loff_t *ppos)
 {
@@ -268,19 +341,251 @@ static ssize_t prl_tg_write(struct file *filp, const char __user *buf,
 	if (ret)
 		return ret;
 
+	sdesc.ubufs = &((struct tg_file *)filp->private_data)->ubufs;
 	ret = call_tg_sync(dev, &sdesc);
 
 	return prl_tg_user_to_host_request_complete(ureq, &sdesc, ret);
 }
 
+struct tg_user_req {
+	struct list_head list;
+	struct tg_file *tf;
+	void __user *ureq;
+	TG_REQ_DESC sdesc;
+	TG_REQUEST src;
+};
+
+/* runs in the completion work, user memory is written back by read() */
+static void tg_user_end_io(TG_REQ_DESC *sdesc, void *data)
+{
+	struct tg_user_req *ur = data;
+	struct tg_file *tf = ur->tf;
+
+	/* tf may be freed as soon as the lock is dropped */
+	spin_lock(&tf->lock);
+	list_add_tail(&ur->list, &tf->done);
+	tf->inflight--;
+	wake_up(&tf->wait);
+	spin_unlock(&tf->lock);
+}
+
+static int tg_file_idle(struct tg_file *tf)
+{
+	int idle;
+
+	spin_lock(&tf->lock);
+	idle = !tf->inflight;
+	spin_unlock(&tf->lock);
+	return idle;
+}
+
+static int tg_file_ready(struct tg_file *tf)
+{
+	int ready;
+
+	spin_lock(&tf->lock);
+	ready = !list_empty(&tf->done);
+	spin_unlock(&tf->lock);
+	return ready;
+}
+
+/* asks the host to cancel requests of the file, they complete as usual */
+static void tg_file_cancel(struct tg_file *tf)
+{
+	struct tg_dev *dev = tf->dev;
+	struct TG_PENDING_REQUEST *req;
+	struct tg_queue *q;
+	unsigned int slot;
+
+	for (q = dev->queues; q < dev->queues + dev->nr_queues; q++) {
+		spin_lock(&q->lock);
+		for_each_set_bit(slot, q->pending, dev->pool.nr) {
+			req = dev->pool.req[slot];
+			if (req->end_io == tg_user_end_io &&
+			    ((struct tg_user_req *)req->end_io_data)->tf == tf)
+				tg_out(dev, TG_PORT_CANCEL, req->phys);
+		}
+		list_for_each_entry(req, &q->pr_list, pr_list)
+			if (req->end_io == tg_user_end_io &&
+			    ((struct tg_user_req *)req->end_io_data)->tf == tf)
+				tg_out(dev, TG_PORT_CANCEL, req->phys);
+		spin_unlock(&q->lock);
+	}
+	/* the host may cancel without an interrupt */
+	schedule_work(&dev->work);
+}
+
+static long prl_tg_submit(struct tg_file *tf, struct tg_submit __user *arg)
+{
+	struct tg_submit ts;
+	struct tg_user_req *ur;
+	unsigned long long ureq;
+	unsigned int i;
+	int ret = 0;
+
+	if (copy_from_user(&ts, arg, sizeof(ts)))
+		return -EFAULT;
+	if (!ts.nr || ts.nr > TG_SUBMIT_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < ts.nr; i++) {
+		if (copy_from_user(&ureq, (void __user *)(unsigned long)
+				   (ts.reqs + i * sizeof(ureq)), sizeof(ureq))) {
+			ret = -EFAULT;
+			break;
+		}
+		/* each request holds its buffers until read() returns it */
+		spin_lock(&tf->lock);
+		if (tf->queued >= TG_SUBMIT_MAX) {
+			spin_unlock(&tf->lock);
+			ret = -EAGAIN;
+			break;
+		}
+		tf->queued++;
+		tf->inflight++;
+		spin_unlock(&tf->lock);
+
+		ur = kmalloc(sizeof(*ur), GFP_KERNEL);
+		if (!ur) {
+			ret = -ENOMEM;
+			goto err_slot;
+		}
+		ur->tf = tf;
+		ur->ureq = (void __user *)(unsigned long)ureq;
+		/* rejects requests reserved for drivers */
+		ret = prl_tg_user_to_host_request_prepare(ur->ureq, &ur->sdesc, &ur->src);
+		if (ret)
+			goto err_free;
+		ur->sdesc.ubufs = &tf->ubufs;
+
+		ret = call_tg_async_submit(tf->dev, &ur->sdesc, tg_user_end_io, ur);
+		if (ret) {
+			prl_tg_user_to_host_request_complete(ur->ureq, &ur->sdesc, ret);
+			goto err_free;
+		}
+	}
+	return i ? i : ret;
+
+err_free:
+	kfree(ur);
+err_slot:
+	spin_lock(&tf->lock);
+	tf->queued--;
+	tf->inflight--;
+	spin_unlock(&tf->lock);
+	return i ? i : ret;
+}
+
+static long prl_tg_register(struct tg_file *tf, struct tg_ubuf_reg __user *arg)
+{
+	struct tg_ubuf_reg reg;
+	int ret;
+
+	if (copy_from_user(&reg, arg, sizeof(reg)))
+		return -EFAULT;
+	if (reg.va != (unsigned long)reg.va)
+		return -EINVAL;
+
+	ret = tg_ubuf_register(tf->dev, &tf->ubufs, (unsigned long)reg.va,
+			       reg.len, reg.writable);
+	if (ret < 0)
+		return ret;
+
+	reg.id = ret;
+	if (copy_to_user(&arg->id, &reg.id, sizeof(reg.id))) {
+		tg_ubuf_unregister(&tf->ubufs, reg.id);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long prl_tg_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct tg_file *tf = filp->private_data;
+	unsigned int id;
+
+	switch (cmd) {
+	case TG_IOCTL_SUBMIT:
+		return prl_tg_submit(tf, (void __user *)arg);
+	case TG_IOCTL_REGISTER:
+		return prl_tg_register(tf, (void __user *)arg);
+	case TG_IOCTL_UNREGISTER:
+		if (get_user(id, (unsigned int __user *)arg))
+			return -EFAULT;
+		return tg_ubuf_unregister(&tf->ubufs, id);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static ssize_t prl_tg_read(struct file *filp, char __user *buf,
+	size_t nbytes, loff_t *ppos)
+{
+	struct tg_file *tf = filp->private_data;
+	struct tg_user_req *ur;
+	struct tg_completion tc;
+	ssize_t done = 0;
+	int ret;
+
+	if (nbytes < sizeof(tc))
+		return -EINVAL;
+	if (!(filp->f_flags & O_NONBLOCK)) {
+		ret = wait_event_interruptible(tf->wait, tg_file_ready(tf));
+		if (ret)
+			return ret;
+	}
+
+	while (done + sizeof(tc) <= nbytes) {
+		ur = NULL;
+		spin_lock(&tf->lock);
+		if (!list_empty(&tf->done)) {
+			ur = list_first_entry(&tf->done, struct tg_user_req, list);
+			list_del(&ur->list);
+			tf->queued--;
+		}
+		spin_unlock(&tf->lock);
+		if (!ur)
+			break;
+
+		tc.req = (unsigned long)ur->ureq;
+		tc.ret = prl_tg_user_to_host_request_complete(ur->ureq, &ur->sdesc, 0);
+		tc.status = ur->src.Status;
+		kfree(ur);
+		if (copy_to_user(buf + done, &tc, sizeof(tc)))
+			return done ? done : -EFAULT;
+		done += sizeof(tc);
+	}
+	return done ? done : -EAGAIN;
+}
+
+static __poll_t prl_tg_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct tg_file *tf = filp->private_data;
+
+	poll_wait(filp, &tf->wait, wait);
+	return tg_file_ready(tf) ? PRLTG_POLLIN : 0;
+}
+
 static int prl_tg_open(struct inode *inode, struct file *filp)
 {
-	(void)inode;
-	(void)filp;
+	struct tg_file *tf;
 
 	if (!try_module_get(THIS_MODULE))
 		return -ENODEV;
 
+	tf = kmalloc(sizeof(*tf), GFP_KERNEL);
+	if (!tf) {
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	tf->dev = prl_pde_data(inode);
+	spin_lock_init(&tf->lock);
+	INIT_LIST_HEAD(&tf->done);
+	tf->inflight = tf->queued = 0;
+	init_waitqueue_head(&tf->wait);
+	tg_ubuf_set_init(&tf->ubufs);
+	filp->private_data = tf;
+
 #ifdef FMODE_ATOMIC_POS
 	filp->f_mode &= ~FMODE_ATOMIC_POS;
 #endif
@@ -289,13 +594,38 @@ static int prl_tg_open(struct inode *inode, struct file *filp)
 
 static int prl_tg_release(struct inode *inode, struct file *filp)
 {
+	struct tg_file *tf = filp->private_data;
+	struct tg_user_req *ur, *n;
+	int timeout = 1;
 	(void)inode;
-	(void)filp;
+
+	if (!tg_file_idle(tf)) {
+		tg_file_cancel(tf);
+		while (!wait_event_timeout(tf->wait, tg_file_idle(tf),
+					   msecs_to_jiffies(timeout)) &&
+		       timeout < 4000) {
+			schedule_work(&tf->dev->work);
+			timeout *= 2;
+		}
+		if (!tg_file_idle(tf)) {
+			/* same trade as in tg_req_cancel_all(), leak rather
+			 * than free memory the host may still write to */
+			printk(KERN_ERR PFX "Host don't handle "
+					"requests' cancel of %p\n", tf);
+			return 0;
+		}
+	}
+
+	list_for_each_entry_safe(ur, n, &tf->done, list) {
+		prl_tg_user_to_host_request_complete(ur->ureq, &ur->sdesc, -ECANCELED);
+		kfree(ur);
+	}
+	tg_ubuf_set_destroy(&tf->ubufs);
+	kfree(tf);
 	module_put(THIS_MODULE);
 	return 0;
 }
 
-
 /* The interrupt handler */
 static irqreturn_t prl_tg_interrupt(int irq, void *dev_instance)
 {
@@ -310,6 +640,8 @@ static irqreturn_t prl_tg_interrupt(int irq, void *dev_instance)
 		/* if it is toolgate's interrupt schedule bottom half */
 		ret = 1;
 		schedule_work(&dev->work);
+		if (atomic_read(&dev->cancel.active))
+			wake_up(&dev->cancel.wait);
 	}
 	DPRINTK("prl_tg exiting interrupt, ret %d\n", ret);
 	return IRQ_RETVAL(ret);
@@ -387,6 +719,8 @@ static int prl_tg_initialize(struct tg_dev *dev)
 		printk(KERN_ERR "no usable DMA configuration\n");
 		goto err_out;
 	}
+	/* buffers are mapped as long contiguous runs, see tg_uple_map() */
+	dma_set_max_seg_size(&pdev->dev, TG_DMA_SEG_MAX);
 
 	rc = pci_request_region(pdev, io_bar, board_info[dev->board].nick);
 	if (rc) {
@@ -419,7 +753,60 @@ out:
 	return rc;
 }
 
-static struct proc_dir_entry *
+static int prl_tg_stats_show(struct seq_file *m, void *v)
+{
+	struct tg_dev *dev = m->private;
+	struct tg_req_pool *pool = &dev->pool;
+
+	seq_printf(m, "transport: %s\n", dev->transport->name);
+	seq_printf(m, "queues: %u\n", dev->nr_queues);
+	seq_printf(m, "pool_slots: %u\n", pool->nr);
+	seq_printf(m, "pool_inuse: %d\n", atomic_read(&pool->inuse));
+	seq_printf(m, "pool_peak: %d\n", atomic_read(&pool->peak));
+	seq_printf(m, "pool_hits: %ld\n", atomic_long_read(&pool->hits));
+	seq_printf(m, "pool_exhausted: %ld\n", atomic_long_read(&pool->exhausted));
+	seq_printf(m, "pool_oversize: %ld\n", atomic_long_read(&pool->oversize));
+	seq_printf(m, "poll_us: %u\n", tg_poll_us);
+	seq_printf(m, "poll_hits: %ld\n", atomic_long_read(&dev->poll.hits));
+	seq_printf(m, "poll_misses: %ld\n", atomic_long_read(&dev->poll.misses));
+	seq_printf(m, "poll_skipped: %ld\n", atomic_long_read(&dev->poll.skipped));
+	seq_printf(m, "cancel_runs: %u\n", dev->cancel.runs);
+	seq_printf(m, "cancel_last_requests: %u\n", dev->cancel.last_nr);
+	seq_printf(m, "cancel_last_ms: %u\n", dev->cancel.last_ms);
+	seq_printf(m, "cancel_max_ms: %u\n", dev->cancel.max_ms);
+	seq_printf(m, "cancel_leaked: %u\n", dev->cancel.leaked);
+	tg_stats_show(m, dev);
+	return 0;
+}
+
+static int prl_tg_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, prl_tg_stats_show, prl_pde_data(inode));
+}
+
+/* any write starts the counters over */
+static ssize_t prl_tg_stats_write(struct file *filp, const char __user *buf,
+	size_t nbytes, loff_t *ppos)
+{
+	struct tg_dev *dev = ((struct seq_file *)filp->private_data)->private;
+	struct tg_req_pool *pool = &dev->pool;
+
+	atomic_set(&pool->peak, atomic_read(&pool->inuse));
+	atomic_long_set(&pool->hits, 0);
+	atomic_long_set(&pool->exhausted, 0);
+	atomic_long_set(&pool->oversize, 0);
+	atomic_long_set(&dev->poll.hits, 0);
+	atomic_long_set(&dev->poll.misses, 0);
+	atomic_long_set(&dev->poll.skipped, 0);
+	tg_stats_reset(dev);
+	return nbytes;
+}
+
+static struct proc_ops prl_tg_stats_ops = PRLTG_PROC_SEQ_OPS_INIT(
+		prl_tg_stats_open,
+		prl_tg_stats_write);
+
+struct proc_dir_entry *
 prltg_proc_create_data(char *name, umode_t mode, struct proc_dir_entry *parent,
                        struct proc_ops *proc_ops, void *data)
 {
@@ -477,8 +864,12 @@ int prl_tg_probe_common(struct tg_dev *dev, board_t board,
 	dev->mem_size = 0;
 #endif
 	spin_lock_init(&dev->lock);
-	spin_lock_init(&dev->queue_lock);
-	INIT_LIST_HEAD(&dev->pr_list);
+	memset(&dev->poll, 0, sizeof(dev->poll));
+	memset(&dev->cancel, 0, sizeof(dev->cancel));
+	init_waitqueue_head(&dev->cancel.wait);
+	/* a single queue until the pool is set up */
+	dev->pool.nr = 0;
+	tg_queues_init(dev);
 	dev->board = board;
 
 	/* masks interrupts on the device probing */
@@ -489,13 +880,21 @@ int prl_tg_probe_common(struct tg_dev *dev, board_t board,
 	 * call be here or not!
 	tg_out32(dev, TG_PORT_MASK, 0); */
 
+	INIT_WORK(&dev->work, tg_do_work);
+
 	rc = prl_tg_initialize(dev);
 	if (rc) {
 		kfree(dev);
 		goto out;
 	}
 
-	INIT_WORK(&dev->work, tg_do_work);
+	tg_transport_select(dev);
+	tg_stats_init(dev);
+
+	/* requests still work without the pool, just slower */
+	if (tg_pool_init(dev))
+		printk(KERN_WARNING PFX "no request pool, using vmalloc\n");
+	tg_queues_split(dev);
 
 	/* enable interrupt */
 	tg_out32(dev, TG_PORT_MASK, TG_MASK_COMPLETE);
@@ -505,17 +904,27 @@ int prl_tg_probe_common(struct tg_dev *dev, board_t board,
 	}
 	if (board != VIDEO_DRM_TOOLGATE) {
 		struct proc_dir_entry *p;
-		char proc_file[16];
-		snprintf(proc_file, 16, "driver/%s", board_info[board].nick);
+		char proc_file[32];
+		snprintf(proc_file, 32, "driver/%s", board_info[board].nick);
 
 		p = prltg_proc_create_data(proc_file,
-			S_IWUGO | ((dev->board == VIDEO_TOOLGATE) ? S_IRUGO : 0), NULL,
+			S_IWUGO | S_IRUGO, NULL,
 			proc_ops, dev);
 		if (p)
 			PROC_OWNER(p, THIS_MODULE);
 		else
 			printk(KERN_WARNING "cannot create %s proc entry\n", proc_file);
+
+		snprintf(proc_file, 32, "driver/%s_stats", board_info[board].nick);
+		p = prltg_proc_create_data(proc_file, S_IWUSR | S_IRUGO, NULL,
+			&prl_tg_stats_ops, dev);
+		if (p)
+			PROC_OWNER(p, THIS_MODULE);
+		else
+			printk(KERN_WARNING "cannot create %s proc entry\n", proc_file);
 	}
+	if (board == TOOLGATE && tg_bench_init(dev))
+		printk(KERN_WARNING PFX "cannot create benchmark proc entry\n");
 
 	printk(KERN_INFO "detected %s, base addr %08lx, IRQ %d\n",
 		board_info[board].name, dev->base_addr, dev->irq);
@@ -552,20 +961,27 @@ void prl_tg_remove_common(struct tg_dev *dev)
 {
 	assert(dev != NULL);
 
+	/* waits for a benchmark run in progress */
+	tg_bench_destroy(dev);
 	if (dev->board != VIDEO_DRM_TOOLGATE) {
-		char proc_file[16];
-		snprintf(proc_file, 15, "driver/%s", board_info[dev->board].nick);
+		char proc_file[32];
+		snprintf(proc_file, 32, "driver/%s_stats", board_info[dev->board].nick);
+		remove_proc_entry(proc_file, NULL);
+		snprintf(proc_file, 32, "driver/%s", board_info[dev->board].nick);
 		remove_proc_entry(proc_file, NULL);
 	}
 
 	prl_tg_deinitialize(dev);
+	tg_pool_destroy(dev);
 }
 EXPORT_SYMBOL(prl_tg_remove_common);
 
-static struct proc_ops prl_tg_ops = PRLTG_PROC_OPS_INIT(
+static struct proc_ops prl_tg_ops = PRLTG_PROC_OPS_RW_INIT(
 		prl_tg_open,
+		prl_tg_read,
 		prl_tg_write,
-		NULL, NULL,
+		prl_tg_poll,
+		prl_tg_ioctl,
 		prl_tg_release);
 
 #ifdef CONFIG_PM
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 1999-2018 Parallels International GmbH. All Rights Reserved.
+ */
+
+/*
+ * Round trip benchmark of in-kernel requests, built with PRLTG_BENCH=1.
+ * Writing "sync <requests>" or "async <requests> <depth>" to
+ * /proc/driver/prl_tg_bench sends that many TG_REQUEST_FS_NOOP requests
+ * from the writer's context, reading the file returns the last result as
+ * one line of key=value pairs, the format tg_test prints as well.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
+#include "prltg_common.h"
+#include "prltg_compat.h"
+#include "prltg_call.h"
+
+#define TG_BENCH_MAX_REQUESTS	(1U << 20)
+#define TG_BENCH_MAX_DEPTH	64
+#define TG_BENCH_FILE		"driver/" TOOLGATE_NICK_NAME "_bench"
+
+struct tg_bench {
+	struct mutex lock;		/* one run at a time */
+	int async;
+	unsigned int nr;
+	unsigned int depth;
+	unsigned int errors;
+	u64 ns;
+	u32 lat[5];			/* p50, p90, p99, p99.9, max */
+};
+
+struct tg_bench_slot {
+	TG_REQUEST req;
+	TG_REQ_DESC sdesc;
+	struct TG_PENDING_REQUEST *pending;
+	u64 start;
+};
+
+static void tg_bench_init_desc(TG_REQUEST *req, TG_REQ_DESC *sdesc)
+{
+	memset(req, 0, sizeof(*req));
+	memset(sdesc, 0, sizeof(*sdesc));
+	req->Request = TG_REQUEST_FS_NOOP;
+	sdesc->src = req;
+}
+
+static u32 tg_bench_elapsed(u64 start)
+{
+	u64 t = prl_clock_ns() - start;
+
+	return t > UINT_MAX ? UINT_MAX : t;
+}
+
+static int tg_bench_sync(struct tg_dev *dev, u32 *lat, unsigned int nr)
+{
+	struct tg_bench_slot s;
+	unsigned int i, errors = 0;
+	u64 start;
+
+	for (i = 0; i < nr; i++) {
+		tg_bench_init_desc(&s.req, &s.sdesc);
+		start = prl_clock_ns();
+		if (call_tg_sync(dev, &s.sdesc) ||
+		    s.req.Status != TG_STATUS_SUCCESS)
+			errors++;
+		lat[i] = tg_bench_elapsed(start);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+	}
+	return errors;
+}
+
+static void tg_bench_start(struct tg_dev *dev, struct tg_bench_slot *s)
+{
+	tg_bench_init_desc(&s->req, &s->sdesc);
+	/* stays pending only if the request could not be created at all */
+	s->req.Status = TG_STATUS_PENDING;
+	s->start = prl_clock_ns();
+	s->pending = call_tg_async_start(dev, &s->sdesc);
+}
+
+/* keeps depth requests in flight, latency is counted from each own start */
+static int tg_bench_async(struct tg_dev *dev, u32 *lat, unsigned int nr,
+			  unsigned int depth)
+{
+	struct tg_bench_slot *slots, *s;
+	unsigned int i, errors = 0;
+	int ret = 0;
+
+	slots = kcalloc(depth, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < depth && i < nr; i++)
+		tg_bench_start(dev, &slots[i]);
+	for (i = 0; i < nr; i++) {
+		s = &slots[i % depth];
+		call_tg_async_wait(s->pending);
+		s->pending = NULL;
+		lat[i] = tg_bench_elapsed(s->start);
+		if (s->req.Status != TG_STATUS_SUCCESS)
+			errors++;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		if (i + depth < nr)
+			tg_bench_start(dev, s);
+	}
+	/* interrupted, collect what is still in flight */
+	for (i = 0; i < depth; i++)
+		call_tg_async_cancel(slots[i].pending);
+
+	kfree(slots);
+	return ret ? ret : errors;
+}
+
+static int tg_bench_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int tg_bench_run(struct tg_dev *dev, int async, unsigned int nr,
+			unsigned int depth)
+{
+	struct tg_bench *b = dev->bench;
+	static const unsigned int pct[] = { 500, 900, 990, 999, 1000 };
+	u64 start, ns;
+	u32 *lat;
+	int ret;
+	unsigned int i;
+
+	lat = vmalloc(nr * sizeof(*lat));
+	if (!lat)
+		return -ENOMEM;
+
+	start = prl_clock_ns();
+	if (async)
+		ret = tg_bench_async(dev, lat, nr, depth);
+	else
+		ret = tg_bench_sync(dev, lat, nr);
+	ns = prl_clock_ns() - start;
+	if (ret < 0)
+		goto out;
+
+	sort(lat, nr, sizeof(*lat), tg_bench_cmp, NULL);
+	b->async = async;
+	b->nr = nr;
+	b->depth = async ? depth : 1;
+	b->errors = ret;
+	b->ns = ns;
+	for (i = 0; i < ARRAY_SIZE(pct); i++)
+		b->lat[i] = lat[(u64)(nr - 1) * pct[i] / 1000];
+	ret = 0;
+out:
+	vfree(lat);
+	return ret;
+}
+
+static int prl_tg_bench_show(struct seq_file *m, void *v)
+{
+	struct tg_dev *dev = m->private;
+	struct tg_bench *b = dev->bench;
+
+	mutex_lock(&b->lock);
+	if (b->nr)
+		seq_printf(m, "mode=%s op=0x%x requests=%u depth=%u errors=%u "
+			   "ns=%llu ops_per_s=%llu p50_ns=%u p90_ns=%u "
+			   "p99_ns=%u p999_ns=%u max_ns=%u\n",
+			   b->async ? "async" : "sync", TG_REQUEST_FS_NOOP,
+			   b->nr, b->depth, b->errors,
+			   (unsigned long long)b->ns,
+			   (unsigned long long)div64_u64((u64)b->nr * NSEC_PER_SEC,
+							 b->ns ? : 1),
+			   b->lat[0], b->lat[1], b->lat[2], b->lat[3], b->lat[4]);
+	mutex_unlock(&b->lock);
+	return 0;
+}
+
+static int prl_tg_bench_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, prl_tg_bench_show, prl_pde_data(inode));
+}
+
+static ssize_t prl_tg_bench_write(struct file *filp, const char __user *buf,
+	size_t nbytes, loff_t *ppos)
+{
+	struct tg_dev *dev = ((struct seq_file *)filp->private_data)->private;
+	struct tg_bench *b = dev->bench;
+	char cmd[64], mode[8];
+	unsigned int nr, depth = 1;
+	int n, ret;
+
+	if (nbytes >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, nbytes))
+		return -EFAULT;
+	cmd[nbytes] = 0;
+
+	n = sscanf(cmd, "%7s %u %u", mode, &nr, &depth);
+	if (n < 2 || !nr || nr > TG_BENCH_MAX_REQUESTS ||
+	    !depth || depth > TG_BENCH_MAX_DEPTH)
+		return -EINVAL;
+	if (strcmp(mode, "sync") && strcmp(mode, "async"))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&b->lock))
+		return -ERESTARTSYS;
+	ret = tg_bench_run(dev, !strcmp(mode, "async"), nr, depth);
+	mutex_unlock(&b->lock);
+	return ret ? ret : nbytes;
+}
+
+static struct proc_ops prl_tg_bench_ops = PRLTG_PROC_SEQ_OPS_INIT(
+		prl_tg_bench_open,
+		prl_tg_bench_write);
+
+int tg_bench_init(struct tg_dev *dev)
+{
+	struct proc_dir_entry *p;
+
+	dev->bench = kzalloc(sizeof(*dev->bench), GFP_KERNEL);
+	if (!dev->bench)
+		return -ENOMEM;
+	mutex_init(&dev->bench->lock);
+
+	p = prltg_proc_create_data(TG_BENCH_FILE, S_IWUSR | S_IRUSR, NULL,
+				   &prl_tg_bench_ops, dev);
+	if (!p) {
+		kfree(dev->bench);
+		dev->bench = NULL;
+		return -ENOMEM;
+	}
+	PROC_OWNER(p, THIS_MODULE);
+	return 0;
+}
+
+void tg_bench_destroy(struct tg_dev *dev)
+{
+	if (!dev->bench)
+		return;
+	remove_proc_entry(TG_BENCH_FILE, NULL);
+	kfree(dev->bench);
+	dev->bench = NULL;
+}
@@ -8,10 +8,238 @@
 #include <linux/vmalloc.h>
 #include <linux/interrupt.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include "prltg_common.h"
 #include "prltg_compat.h"
 #include "../Interfaces/prltg_call.h"
 
+int tg_pool_init(struct tg_dev *dev)
+{
+	struct tg_req_pool *pool = &dev->pool;
+	struct device *d = &dev->pci_dev->dev;
+
+	memset(pool, 0, sizeof(*pool));
+	for (pool->nr = 0; pool->nr < TG_POOL_SLOTS; pool->nr++) {
+		pool->va[pool->nr] = dma_alloc_coherent(d, PAGE_SIZE,
+				&pool->dma[pool->nr], GFP_KERNEL);
+		if (!pool->va[pool->nr])
+			break;
+	}
+	DPRINTK("%u request slots\n", pool->nr);
+	return pool->nr ? 0 : -ENOMEM;
+}
+
+void tg_pool_destroy(struct tg_dev *dev)
+{
+	struct tg_req_pool *pool = &dev->pool;
+	unsigned int i;
+
+	/* the host may still write to slots of requests it never cancelled */
+	if (atomic_read(&pool->inuse)) {
+		printk(KERN_ERR PFX "%d request slots still in use\n",
+			atomic_read(&pool->inuse));
+		return;
+	}
+	for (i = 0; i < pool->nr; i++)
+		dma_free_coherent(&dev->pci_dev->dev, PAGE_SIZE,
+				  pool->va[i], pool->dma[i]);
+	pool->nr = 0;
+}
+
+void tg_queues_init(struct tg_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < TG_MAX_QUEUES; i++) {
+		spin_lock_init(&dev->queues[i].lock);
+		INIT_LIST_HEAD(&dev->queues[i].pr_list);
+		bitmap_zero(dev->queues[i].pending, TG_POOL_SLOTS);
+	}
+	dev->nr_queues = 1;
+	dev->queue_slots = 0;
+}
+
+/* splits the pool slots between the queues, called once the pool is set up */
+void tg_queues_split(struct tg_dev *dev)
+{
+	unsigned int nr = min_t(unsigned int, num_possible_cpus(), TG_MAX_QUEUES);
+
+	if (!dev->pool.nr)
+		return;
+	nr = min(nr, dev->pool.nr);
+	dev->queue_slots = DIV_ROUND_UP(dev->pool.nr, nr);
+	dev->nr_queues = DIV_ROUND_UP(dev->pool.nr, dev->queue_slots);
+	DPRINTK("%u queues, %u slots each\n", dev->nr_queues, dev->queue_slots);
+}
+
+void tg_stats_init(struct tg_dev *dev)
+{
+	memset(dev->stats.ops, 0, sizeof(dev->stats.ops));
+	tg_stats_reset(dev);
+}
+
+/* slot of the opcode, taken on first use */
+static unsigned int tg_stats_slot(struct tg_stats *stats, u32 op)
+{
+	unsigned int i, h = hash_32(op, TG_STATS_OP_BITS);
+	u32 cur;
+
+	if (op == TG_REQUEST_INVALID)
+		return TG_STATS_OPS;
+
+	for (i = 0; i < TG_STATS_OPS; i++, h = (h + 1) % TG_STATS_OPS) {
+		cur = stats->ops[h];
+		if (!cur)
+			cur = cmpxchg(&stats->ops[h], 0, op) ? : op;
+		if (cur == op)
+			return h;
+	}
+	return TG_STATS_OPS;
+}
+
+static void tg_stats_submit(struct TG_PENDING_REQUEST *req)
+{
+	struct tg_stats *stats = &req->dev->stats;
+
+	atomic64_inc(&stats->op[tg_stats_slot(stats, req->dst->Request)].submits);
+}
+
+static void tg_stats_complete(struct TG_PENDING_REQUEST *req)
+{
+	struct tg_stats *stats = &req->dev->stats;
+	TG_REQ_DESC *sdesc = req->sdesc;
+	u32 status = req->dst->Status;
+	struct tg_op_stats *os;
+	u64 bytes = 0, us;
+	unsigned int i, b;
+
+	/* never reached the host */
+	if (!req->start_ns)
+		return;
+
+	us = (prl_clock_ns() - req->start_ns) >> 10;
+	b = us ? min_t(unsigned int, fls64(us), TG_STATS_LAT - 1) : 0;
+	for (i = 0; i < sdesc->src->BufferCount; i++)
+		bytes += sdesc->sbuf[i].ByteCount;
+
+	os = &stats->op[tg_stats_slot(stats, req->dst->Request)];
+	atomic64_inc(&os->completions);
+	atomic64_add(bytes, &os->bytes);
+	atomic64_inc(&os->lat[b]);
+	if (status != TG_STATUS_SUCCESS) {
+		atomic64_inc(&os->errors);
+		i = status - TG_STATUS_CANCELLED;
+		atomic64_inc(&stats->status[min_t(u32, i, TG_STATS_STATUSES - 1)]);
+	}
+}
+
+#define tg_stat(x) ((unsigned long long)atomic64_read(&(x)))
+
+void tg_stats_show(struct seq_file *m, struct tg_dev *dev)
+{
+	struct tg_op_stats *os;
+	unsigned int slot, i;
+	u64 n;
+
+	for (slot = 0; slot <= TG_STATS_OPS; slot++) {
+		os = &dev->stats.op[slot];
+		if (!tg_stat(os->submits) && !tg_stat(os->completions))
+			continue;
+		if (slot < TG_STATS_OPS)
+			seq_printf(m, "op_%#x:", dev->stats.ops[slot]);
+		else
+			seq_printf(m, "op_other:");
+		seq_printf(m, " submits %llu completions %llu errors %llu bytes %llu lat_us",
+			   tg_stat(os->submits), tg_stat(os->completions),
+			   tg_stat(os->errors), tg_stat(os->bytes));
+		for (i = 0; i < TG_STATS_LAT; i++)
+			if ((n = tg_stat(os->lat[i])))
+				seq_printf(m, " <%lu:%llu", 1UL << i, n);
+		seq_printf(m, "\n");
+	}
+
+	for (i = 0; i < TG_STATS_STATUSES; i++) {
+		n = tg_stat(dev->stats.status[i]);
+		if (!n)
+			continue;
+		if (i < TG_STATS_STATUSES - 1)
+			seq_printf(m, "status_%#x: %llu\n", TG_STATUS_CANCELLED + i, n);
+		else
+			seq_printf(m, "status_other: %llu\n", n);
+	}
+}
+
+/* opcodes keep their slots, only the counters start over */
+void tg_stats_reset(struct tg_dev *dev)
+{
+	struct tg_op_stats *os;
+	unsigned int i;
+
+	for (os = dev->stats.op; os <= dev->stats.op + TG_STATS_OPS; os++) {
+		atomic64_set(&os->submits, 0);
+		atomic64_set(&os->completions, 0);
+		atomic64_set(&os->errors, 0);
+		atomic64_set(&os->bytes, 0);
+		for (i = 0; i < TG_STATS_LAT; i++)
+			atomic64_set(&os->lat[i], 0);
+	}
+	for (i = 0; i < TG_STATS_STATUSES; i++)
+		atomic64_set(&dev->stats.status[i], 0);
+}
+
+static int tg_pool_find(struct tg_req_pool *pool, unsigned int first,
+			unsigned int end)
+{
+	int slot;
+
+	do {
+		slot = find_next_zero_bit(pool->used, end, first);
+		if (slot >= end)
+			return -1;
+	} while (test_and_set_bit(slot, pool->used));
+	return slot;
+}
+
+/* prefers a slot of queue q, so that its lock stays local to the CPU */
+static int tg_pool_get(struct tg_dev *dev, struct tg_queue *q)
+{
+	struct tg_req_pool *pool = &dev->pool;
+	unsigned int first = (q - dev->queues) * dev->queue_slots;
+	int slot, inuse, peak;
+
+	slot = tg_pool_find(pool, first,
+			    min(first + dev->queue_slots, pool->nr));
+	if (slot < 0)
+		slot = tg_pool_find(pool, 0, pool->nr);
+	if (slot < 0) {
+		atomic_long_inc(&pool->exhausted);
+		return -1;
+	}
+
+	atomic_long_inc(&pool->hits);
+	inuse = atomic_inc_return(&pool->inuse);
+	while ((peak = atomic_read(&pool->peak)) < inuse &&
+	       atomic_cmpxchg(&pool->peak, peak, inuse) != peak)
+		;
+	return slot;
+}
+
+static void tg_pool_put(struct tg_req_pool *pool, int slot)
+{
+	atomic_dec(&pool->inuse);
+	clear_bit(slot, pool->used);
+}
+
+static void tg_req_free_dst(struct TG_PENDING_REQUEST *req)
+{
+	if (req->slot >= 0)
+		tg_pool_put(&req->dev->pool, req->slot);
+	else
+		vfree(req->dst);
+}
+
 static int tg_req_paged_size(TG_REQ_DESC *sdesc)
 {
 	TG_REQUEST *src;
@@ -53,6 +281,343 @@ static int tg_req_paged_size(TG_REQ_DESC *sdesc)
 	return dsize;
 }
 
+void tg_ubuf_set_init(struct tg_ubuf_set *set)
+{
+	spin_lock_init(&set->lock);
+	INIT_LIST_HEAD(&set->list);
+	set->nr = 0;
+	set->next_id = 1;
+}
+
+static int tg_ubuf_pin(struct tg_ubuf *ub)
+{
+	int got;
+
+	prl_mmap_read_lock(current->mm);
+#ifdef PRLTG_UBUF_PIN
+	got = prl_pin_user_pages(ub->va & PAGE_MASK, ub->npages, ub->writable,
+				 ub->pages);
+#else
+	got = prl_get_user_pages(ub->va & PAGE_MASK, ub->npages, ub->writable,
+				 ub->pages, NULL);
+#endif
+	prl_mmap_read_unlock(current->mm);
+	return got;
+}
+
+static void tg_ubuf_unpin(struct tg_ubuf *ub, unsigned int nr, int dirty)
+{
+#ifdef PRLTG_UBUF_PIN
+	unpin_user_pages_dirty_lock(ub->pages, nr, dirty);
+#else
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (dirty)
+			SetPageDirty(ub->pages[i]);
+		page_cache_release(ub->pages[i]);
+	}
+#endif
+}
+
+/* charges the pages to the registering user */
+static int tg_ubuf_account(struct tg_ubuf *ub)
+{
+#ifdef PRLTG_UBUF_PIN
+	unsigned long limit, cur, new;
+
+	if (!capable(CAP_IPC_LOCK)) {
+		limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+		ub->user = get_uid(current_user());
+		do {
+			cur = atomic_long_read(&ub->user->locked_vm);
+			new = cur + ub->npages;
+			if (new > limit) {
+				free_uid(ub->user);
+				ub->user = NULL;
+				return -ENOMEM;
+			}
+		} while (atomic_long_cmpxchg(&ub->user->locked_vm, cur, new) != cur);
+	}
+	return 0;
+#else
+	return capable(CAP_IPC_LOCK) ? 0 : -EPERM;
+#endif
+}
+
+static void tg_ubuf_unaccount(struct tg_ubuf *ub)
+{
+#ifdef PRLTG_UBUF_PIN
+	if (ub->user) {
+		atomic_long_sub(ub->npages, &ub->user->locked_vm);
+		free_uid(ub->user);
+	}
+#endif
+}
+
+static void tg_ubuf_put(struct tg_ubuf *ub)
+{
+	struct pci_dev *pdev = ub->dev->pci_dev;
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&ub->users))
+		return;
+
+	for (i = 0; i < ub->npages; i++)
+		prl_dma_unmap_page(pdev, ub->dma[i], PAGE_SIZE, DMA_BIDIRECTIONAL);
+	tg_ubuf_unpin(ub, ub->npages, ub->writable);
+	tg_ubuf_unaccount(ub);
+	vfree(ub->dma);
+	vfree(ub->pages);
+	kfree(ub);
+}
+
+int tg_ubuf_register(struct tg_dev *dev, struct tg_ubuf_set *set,
+		     unsigned long va, unsigned int len, int writable)
+{
+	struct pci_dev *pdev = dev->pci_dev;
+	struct tg_ubuf *ub;
+	int got = 0, ret = -ENOMEM;
+	unsigned int i;
+
+	DPRINTK("ENTER va:%lx len:%u\n", va, len);
+
+	if (!len || len > TG_UBUF_MAX_LEN || va + len < va)
+		return -EINVAL;
+
+	ub = kzalloc(sizeof(*ub), GFP_KERNEL);
+	if (!ub)
+		goto err;
+
+	ub->dev = dev;
+	ub->va = va;
+	ub->len = len;
+	ub->writable = !!writable;
+	ub->npages = ((va & ~PAGE_MASK) + len + ~PAGE_MASK) >> PAGE_SHIFT;
+	atomic_set(&ub->users, 1);
+	ub->mm = current->mm;
+	ub->pages = vmalloc(sizeof(struct page *) * ub->npages);
+	ub->dma = vmalloc(sizeof(dma_addr_t) * ub->npages);
+	if (!ub->pages || !ub->dma)
+		goto err_free;
+
+	ret = tg_ubuf_account(ub);
+	if (ret)
+		goto err_free;
+
+	got = tg_ubuf_pin(ub);
+	if (got < (int)ub->npages) {
+		DPRINTK("[1] %d < %u\n", got, ub->npages);
+		ret = -EFAULT;
+		goto err_put;
+	}
+
+	ret = -ENOMEM;
+	for (i = 0; i < ub->npages; i++) {
+		ub->dma[i] = prl_dma_map_page(pdev, ub->pages[i], 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+		if (!ub->dma[i])
+			goto err_unmap;
+	}
+
+	spin_lock(&set->lock);
+	if (set->nr >= TG_UBUF_MAX) {
+		spin_unlock(&set->lock);
+		ret = -ENOSPC;
+		goto err_unmap;
+	}
+	ub->id = set->next_id++;
+	set->nr++;
+	list_add_tail(&ub->list, &set->list);
+	spin_unlock(&set->lock);
+
+	DPRINTK("EXIT id:%u\n", ub->id);
+	return ub->id;
+
+err_unmap:
+	while (i-- > 0)
+		prl_dma_unmap_page(pdev, ub->dma[i], PAGE_SIZE, DMA_BIDIRECTIONAL);
+err_put:
+	if (got > 0)
+		tg_ubuf_unpin(ub, got, 0);
+	tg_ubuf_unaccount(ub);
+err_free:
+	vfree(ub->dma);
+	vfree(ub->pages);
+	kfree(ub);
+err:
+	DPRINTK("EXIT %d\n", ret);
+	return ret;
+}
+
+/* requests still using the buffer keep it mapped until they complete */
+int tg_ubuf_unregister(struct tg_ubuf_set *set, unsigned int id)
+{
+	struct tg_ubuf *ub;
+
+	spin_lock(&set->lock);
+	list_for_each_entry(ub, &set->list, list) {
+		if (ub->id == id) {
+			list_del(&ub->list);
+			set->nr--;
+			spin_unlock(&set->lock);
+			tg_ubuf_put(ub);
+			return 0;
+		}
+	}
+	spin_unlock(&set->lock);
+	return -ENOENT;
+}
+
+void tg_ubuf_set_destroy(struct tg_ubuf_set *set)
+{
+	struct tg_ubuf *ub, *tmp;
+
+	list_for_each_entry_safe(ub, tmp, &set->list, list) {
+		list_del(&ub->list);
+		tg_ubuf_put(ub);
+	}
+	set->nr = 0;
+}
+
+/*
+ * Registered buffer wholly containing sbuf, with a reference taken. Only
+ * the registering address space may use it: after fork() or passing the
+ * file the same va is other memory. The mm is only compared, holding it
+ * would need the GPL only mmdrop().
+ */
+static struct tg_ubuf *tg_ubuf_get(struct tg_ubuf_set *set, TG_BUFFER *sbuf)
+{
+	unsigned long va = sbuf->u.Va;
+	struct tg_ubuf *ub;
+
+	spin_lock(&set->lock);
+	list_for_each_entry(ub, &set->list, list) {
+		if (ub->mm == current->mm &&
+		    va >= ub->va && va - ub->va < ub->len &&
+		    sbuf->ByteCount <= ub->len - (va - ub->va) &&
+		    (ub->writable || !sbuf->Writable)) {
+			atomic_inc(&ub->users);
+			spin_unlock(&set->lock);
+			return ub;
+		}
+	}
+	spin_unlock(&set->lock);
+	return NULL;
+}
+
+/* returns NULL if the buffer is not registered and has to be pinned */
+static TG_PAGED_BUFFER *tg_req_map_ubuf(struct TG_PENDING_REQUEST *req,
+	TG_PAGED_BUFFER *dbuf, TG_BUFFER *sbuf, int npages)
+{
+	struct pci_dev *pdev = req->dev->pci_dev;
+	struct up_list_entry *uple;
+	struct tg_ubuf *ub;
+	u64 *pfn = (u64 *)dbuf;
+	unsigned int i;
+
+	ub = tg_ubuf_get(req->sdesc->ubufs, sbuf);
+	if (!ub)
+		return NULL;
+
+	uple = kmalloc(sizeof(struct up_list_entry), GFP_KERNEL);
+	if (!uple) {
+		tg_ubuf_put(ub);
+		return ERR_PTR(-ENOMEM);
+	}
+	uple->writable = 0;
+	uple->count = 0;
+	uple->ub = ub;
+
+	i = (sbuf->u.Va >> PAGE_SHIFT) - (ub->va >> PAGE_SHIFT);
+	for (; npages > 0; npages--, i++) {
+		prl_dma_sync_for_device(pdev, ub->dma[i], PAGE_SIZE, DMA_BIDIRECTIONAL);
+		*(pfn++) = (u64)ub->dma[i] >> PAGE_SHIFT;
+	}
+
+	list_add(&uple->up_list, &req->up_list);
+	return (TG_PAGED_BUFFER *)pfn;
+}
+
+/*
+ * Maps the pages in as few segments as they are physically contiguous,
+ * so a buffer backed by huge pages takes few dma_map_sg() segments. A
+ * segment is not longer than the device takes, which is what swiotlb can
+ * bounce at once. The host still takes a frame number per page, pfn gets
+ * npages of them.
+ */
+static int tg_uple_map(struct pci_dev *pdev, struct up_list_entry *uple,
+		       int npages, u64 *pfn)
+{
+	unsigned int max = max_t(unsigned int, PAGE_SIZE,
+				 dma_get_max_seg_size(&pdev->dev) & PAGE_MASK);
+	struct scatterlist *sg;
+	int i, nsegs, nents;
+	unsigned int len;
+
+	for (i = 1, nsegs = 1, len = PAGE_SIZE; i < npages; i++) {
+		if (page_to_pfn(uple->p[i]) == page_to_pfn(uple->p[i - 1]) + 1 &&
+		    len < max) {
+			len += PAGE_SIZE;
+			continue;
+		}
+		nsegs++;
+		len = PAGE_SIZE;
+	}
+
+	if (sg_alloc_table(&uple->sgt, nsegs, GFP_KERNEL))
+		return -ENOMEM;
+
+	sg = uple->sgt.sgl;
+	sg_set_page(sg, uple->p[0], PAGE_SIZE, 0);
+	for (i = 1; i < npages; i++) {
+		if (page_to_pfn(uple->p[i]) == page_to_pfn(uple->p[i - 1]) + 1 &&
+		    sg->length < max) {
+			sg->length += PAGE_SIZE;
+			continue;
+		}
+		sg = sg_next(sg);
+		sg_set_page(sg, uple->p[i], PAGE_SIZE, 0);
+	}
+
+	nents = prl_dma_map_sg(pdev, uple->sgt.sgl, nsegs, DMA_BIDIRECTIONAL);
+	if (!nents) {
+		DPRINTK("[1] can't map %d segments\n", nsegs);
+		sg_free_table(&uple->sgt);
+		return -ENOMEM;
+	}
+	uple->sgt.nents = nents;
+
+	/* segments are whole pages, an IOMMU may merge them further */
+	for_each_sg(uple->sgt.sgl, sg, nents, i)
+		for (len = 0; len < sg_dma_len(sg); len += PAGE_SIZE)
+			*(pfn++) = (u64)(sg_dma_address(sg) + len) >> PAGE_SHIFT;
+
+	return 0;
+}
+
+static void tg_uple_free(struct pci_dev *pdev, struct up_list_entry *uple)
+{
+	int i;
+
+	if (uple->ub) {
+		tg_ubuf_put(uple->ub);
+		kfree(uple);
+		return;
+	}
+
+	prl_dma_unmap_sg(pdev, uple->sgt.sgl, uple->sgt.orig_nents, DMA_BIDIRECTIONAL);
+	sg_free_table(&uple->sgt);
+
+	if (uple->writable)
+		for(i = 0; i < uple->count; i++)
+			SetPageDirty(uple->p[i]);
+
+	for(i = 0; i < uple->count; i++)
+		page_cache_release(uple->p[i]);
+
+	kfree(uple);
+}
+
 static int tg_req_map_internal(struct TG_PENDING_REQUEST *req)
 {
 	int i, count;
@@ -61,6 +626,12 @@ static int tg_req_map_internal(struct TG_PENDING_REQUEST *req)
 	char* mem = (char*)dst;
 	struct pci_dev *pdev = req->dev->pci_dev;
 
+	/* pool slots are mapped for the device lifetime */
+	if (req->slot >= 0) {
+		dst->RequestPages[0] = req->dev->pool.dma[req->slot] >> PAGE_SHIFT;
+		return 1;
+	}
+
 	count = (((unsigned long)dst & ~PAGE_MASK) +
 			dst->RequestSize + ~PAGE_MASK) >> PAGE_SHIFT;
 
@@ -70,27 +641,23 @@ static int tg_req_map_internal(struct TG_PENDING_REQUEST *req)
 		return -ENOMEM;
 
 	uple->writable = 0;
-	uple->count = 0;
+	uple->count = count;
+	uple->ub = NULL;
 
-	for (i = 0; i < count; i++, mem += PAGE_SIZE, uple->count++) {
+	for (i = 0; i < count; i++, mem += PAGE_SIZE) {
 		uple->p[i] = vmalloc_to_page(mem);
 		page_cache_get(uple->p[i]);
-
-		dst->RequestPages[i] = prl_dma_map_page(pdev, uple->p[i], 0, PAGE_SIZE, DMA_BIDIRECTIONAL) >> PAGE_SHIFT;
-		if (!dst->RequestPages[i]) {
-			page_cache_release(uple->p[i]);
-			goto err;
-		}
 	}
 
-	list_add(&uple->up_list, &req->up_list);
+	if (tg_uple_map(pdev, uple, count, (u64 *)dst->RequestPages))
+		goto err;
+
+	req->dmap = uple;
 	return count;
 
 err:
-	for (i = 0; i < uple->count; i++) {
-		prl_dma_unmap_page(pdev, dst->RequestPages[i] << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	for (i = 0; i < uple->count; i++)
 		page_cache_release(uple->p[i]);
-	}
 	kfree(uple);
 	return -ENOMEM;
 }
@@ -100,8 +667,7 @@ static TG_PAGED_BUFFER *tg_req_map_user_pages(struct TG_PENDING_REQUEST *req,
 {
 	struct pci_dev *pdev = req->dev->pci_dev;
 	struct up_list_entry *uple;
-	int i, got, mapped = 0;
-	u64 *pfn;
+	int i, got;
 
 	uple = (struct up_list_entry *)kmalloc(sizeof(struct up_list_entry) +
 							sizeof(struct page *) * npages,
@@ -111,6 +677,7 @@ static TG_PAGED_BUFFER *tg_req_map_user_pages(struct TG_PENDING_REQUEST *req,
 
 	uple->writable = sbuf->Writable;
 	uple->count = npages;
+	uple->ub = NULL;
 
 	prl_mmap_read_lock(current->mm);
 	/* lock userspace pages */
@@ -125,26 +692,13 @@ static TG_PAGED_BUFFER *tg_req_map_user_pages(struct TG_PENDING_REQUEST *req,
 		goto err_put;
 	}
 
-	dbuf = (TG_PAGED_BUFFER *)((u64 *)dbuf + npages);
-	pfn = (u64 *)dbuf - 1;
-
-	for (; npages > 0; npages--, mapped++) {
-		dma_addr_t addr = prl_dma_map_page(pdev, uple->p[npages-1], 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
-
-		if (!addr) {
-			DPRINTK("[3] %d < %d	\n", got, npages);
-			goto err_unmap;
-		}
-
-		*(pfn--) = (u64)addr >> PAGE_SHIFT;
+	if (tg_uple_map(pdev, uple, npages, (u64 *)dbuf)) {
+		DPRINTK("[3] can't map %d pages\n", npages);
+		goto err_put;
 	}
 
 	list_add(&uple->up_list, &req->up_list);
-	return dbuf;
-
-err_unmap:
-	for (i = 0; i < mapped; i++, pfn++)
-		prl_dma_unmap_page(pdev, *pfn << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	return (TG_PAGED_BUFFER *)((u64 *)dbuf + npages);
 
 err_put:
 	for(i = 0; i < got; i++)
@@ -159,51 +713,54 @@ static TG_PAGED_BUFFER *tg_req_map_kernel_pages(struct TG_PENDING_REQUEST *req,
 	TG_PAGED_BUFFER *dbuf, TG_BUFFER *sbuf, int npages)
 {
 	int i;
-	u64 *pfn = (u64 *)dbuf;
 	char *buffer = (char *)sbuf->u.Buffer;
 	struct pci_dev *pdev = req->dev->pci_dev;
+	struct up_list_entry *uple;
 
-	for (i = 0; i < npages; i++, buffer += PAGE_SIZE) {
-		dma_addr_t addr;
-		struct page *page;
+	uple = (struct up_list_entry *)kmalloc(sizeof(struct up_list_entry) +
+			sizeof(struct page *) * npages, GFP_KERNEL);
+	if (!uple)
+		return ERR_PTR(-ENOMEM);
+
+	/* kernel pages are owned by the caller, no references are held */
+	uple->writable = 0;
+	uple->count = 0;
+	uple->ub = NULL;
 
+	for (i = 0; i < npages; i++, buffer += PAGE_SIZE) {
 		if (virt_addr_valid(buffer))
-			page = virt_to_page(buffer);
+			uple->p[i] = virt_to_page(buffer);
 		else if (is_vmalloc_addr(buffer))
-			page = vmalloc_to_page(buffer);
+			uple->p[i] = vmalloc_to_page(buffer);
 		else {
 			DPRINTK("[0][%d] va:%p incorrect\n", i, buffer);
 			goto err;
 		}
+	}
 
-		addr = prl_dma_map_page(pdev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
-		if (!addr) {
-			DPRINTK("[2] va:%p can't map\n", buffer);
-			goto err;
-		}
-
-		*(pfn++) = addr >> PAGE_SHIFT;
+	if (tg_uple_map(pdev, uple, npages, (u64 *)dbuf)) {
+		DPRINTK("[2] va:%p can't map\n", sbuf->u.Buffer);
+		goto err;
 	}
 
+	list_add(&uple->up_list, &req->up_list);
 	return (TG_PAGED_BUFFER *)((u64 *)dbuf + npages);
 
 err:
-	for (; i > 0; i--, pfn--)
-		prl_dma_unmap_page(pdev, *pfn << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
-
+	kfree(uple);
 	return ERR_PTR(-ENOMEM);
 }
 
 static inline int tg_req_unmap_internal(struct TG_PENDING_REQUEST *req)
 {
-	int i, count;
-	TG_PAGED_REQUEST *dst = req->dst;
+	int count;
 
-	count = (((unsigned long)dst & ~PAGE_MASK) +
-			dst->RequestSize + ~PAGE_MASK) >> PAGE_SHIFT;
+	if (req->slot >= 0)
+		return 1;
 
-	for (i = 0; i < count; i++)
-		prl_dma_unmap_page(req->dev->pci_dev, dst->RequestPages[i] << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	count = req->dmap->count;
+	tg_uple_free(req->dev->pci_dev, req->dmap);
+	req->dmap = NULL;
 
 	return count;
 }
@@ -211,19 +768,10 @@ static inline int tg_req_unmap_internal(struct TG_PENDING_REQUEST *req)
 static inline void tg_req_unmap_user_pages(struct TG_PENDING_REQUEST *req)
 {
 	struct up_list_entry *uple, *tmp;
-	int i;
 
 	list_for_each_entry_safe(uple, tmp, &req->up_list, up_list) {
 		list_del_init(&uple->up_list);
-
-		if (uple->writable)
-			for(i = 0; i < uple->count; i++)
-				SetPageDirty(uple->p[i]);
-
-		for(i = 0; i < uple->count; i++)
-			page_cache_release(uple->p[i]);
-
-		kfree(uple);
+		tg_uple_free(req->dev->pci_dev, uple);
 	}
 }
 
@@ -263,8 +811,12 @@ static void tg_req_unmap_pages(struct TG_PENDING_REQUEST *req, int nbuf)
 			sbuf->ByteCount = dbuf->ByteCount;
 
 		pfn = (u64 *)(dbuf + 1);
-		for (; npages > 0; npages--, pfn++)
-			prl_dma_unmap_page(pdev, (*pfn) << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
+		/* the registration keeps the mapping, others go with up_list */
+		if (i < 32 && (req->ubuf_mask & (1U << i)))
+			for (; npages > 0; npages--, pfn++)
+				prl_dma_sync_for_cpu(pdev, (*pfn) << PAGE_SHIFT, PAGE_SIZE, DMA_BIDIRECTIONAL);
+		else
+			pfn += npages;
 
 		dbuf = (TG_PAGED_BUFFER *)pfn;
 	}
@@ -284,12 +836,26 @@ static struct TG_PENDING_REQUEST *tg_req_create(struct tg_dev *dev, TG_REQ_DESC
 
 	DPRINTK("ENTER\n");
 
-	req = vmalloc(sizeof(struct TG_PENDING_REQUEST));
+	req = kmalloc(sizeof(struct TG_PENDING_REQUEST), GFP_KERNEL);
 	if (req == NULL)
 		goto err0;
 
 	dsize = tg_req_paged_size(sdesc);
-	if ((dsize < 0) || ((dst = vmalloc(dsize)) == NULL)) {
+	if (dsize < 0)
+		goto err1;
+
+	req->q = tg_queue_local(dev);
+	req->slot = -1;
+	if (dsize <= PAGE_SIZE)
+		req->slot = tg_pool_get(dev, req->q);
+	else
+		atomic_long_inc(&dev->pool.oversize);
+	if (req->slot >= 0)
+		req->q = tg_queue_of_slot(dev, req->slot);
+
+	if (req->slot >= 0)
+		dst = dev->pool.va[req->slot];
+	else if ((dst = vmalloc(dsize)) == NULL) {
 		DPRINTK("ENTER-1: dsize:%d\n", dsize);
 		goto err1;
 	}
@@ -303,6 +869,10 @@ static struct TG_PENDING_REQUEST *tg_req_create(struct tg_dev *dev, TG_REQ_DESC
 	req->dev = dev;
 	req->sdesc = sdesc;
 	req->dst = dst;
+	req->end_io = NULL;
+	req->ubuf_mask = 0;
+	req->dmap = NULL;
+	req->start_ns = 0;
 	INIT_LIST_HEAD(&req->pr_list);
 	INIT_LIST_HEAD(&req->up_list);
 
@@ -336,9 +906,15 @@ static struct TG_PENDING_REQUEST *tg_req_create(struct tg_dev *dev, TG_REQ_DESC
 
 		npages = ((sbuf->u.Va & ~PAGE_MASK) + sbuf->ByteCount + ~PAGE_MASK) >> PAGE_SHIFT;
 
-		if (!prltg_buf_is_kernelspace(sdesc, nbuf))
-			dbuf = tg_req_map_user_pages(req, dbuf + 1, sbuf, npages);
-		else
+		if (!prltg_buf_is_kernelspace(sdesc, nbuf)) {
+			TG_PAGED_BUFFER *next = NULL;
+
+			if (sdesc->ubufs && nbuf < 32)
+				next = tg_req_map_ubuf(req, dbuf + 1, sbuf, npages);
+			if (next && !IS_ERR(next))
+				req->ubuf_mask |= 1U << nbuf;
+			dbuf = next ? next : tg_req_map_user_pages(req, dbuf + 1, sbuf, npages);
+		} else
 			dbuf = tg_req_map_kernel_pages(req, dbuf + 1, sbuf, npages);
 
 		if (IS_ERR(dbuf)) {
@@ -353,36 +929,53 @@ static struct TG_PENDING_REQUEST *tg_req_create(struct tg_dev *dev, TG_REQ_DESC
 err3:
 	tg_req_unmap_pages(req, nbuf);
 err2:
-	vfree(dst);
+	tg_req_free_dst(req);
 err1:
-	vfree(req);
+	kfree(req);
 err0:
 	DPRINTK("EXIT: can't alloc/map memory for request\n");
 	return NULL;
 }
 
+/* drops the submit-time mapping of the first descriptor page */
+static void tg_req_put_head(struct TG_PENDING_REQUEST *req)
+{
+	if (req->slot >= 0)
+		return;
+	page_cache_release(req->pg);
+	prl_dma_unmap_page(req->dev->pci_dev, req->phys, PAGE_SIZE, DMA_BIDIRECTIONAL);
+}
+
 static int tg_req_submit(struct TG_PENDING_REQUEST *req)
 {
 	TG_PAGED_REQUEST *dst = req->dst;
 	struct tg_dev *dev = req->dev;
-	unsigned long lock_flags;
 	int ret = TG_STATUS_CANCELLED;
 	DPRINTK("ENTER\n");
 
-	/*
-	 * Request memory allocated via vmalloc, so this conversion is possible and
-	 * also no any offset inside page needed.
-	 */
-	req->pg = vmalloc_to_page(dst);
-	req->phys = prl_dma_map_page(dev->pci_dev, vmalloc_to_page(dst), 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
-	if (!req->phys) {
-		DPRINTK("Can not allocate memory for DMA mapping\n");
-		goto out;
-	}
+	if (req->slot >= 0) {
+		req->pg = NULL;
+		req->phys = dev->pool.dma[req->slot];
+	} else {
+		/*
+		 * Request memory allocated via vmalloc, so this conversion is possible and
+		 * also no any offset inside page needed.
+		 */
+		req->pg = vmalloc_to_page(dst);
+		req->phys = prl_dma_map_page(dev->pci_dev, vmalloc_to_page(dst), 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+		if (!req->phys) {
+			DPRINTK("Can not allocate memory for DMA mapping\n");
+			/* never reached the host, not counted */
+			req->start_ns = 0;
+			return ret;
+		}
 
-	/* First page must be pinned, others should be pinned by build_request */
-	page_cache_get(req->pg);
+		/* First page must be pinned, others should be pinned by build_request */
+		page_cache_get(req->pg);
+	}
 
+	req->start_ns = prl_clock_ns();
+	tg_stats_submit(req);
 	do {
 		dst->Status = TG_STATUS_PENDING;
 		tg_out(dev, TG_PORT_SUBMIT, req->phys);
@@ -395,32 +988,120 @@ static int tg_req_submit(struct TG_PENDING_REQUEST *req)
 	init_completion(&req->waiting);
 	req->processed = 0;
 
-	spin_lock_irqsave(&dev->queue_lock, lock_flags);
+	spin_lock(&req->q->lock);
 	ret = dst->Status;
 	/* we can miss interrupt */
-	if (ret == TG_STATUS_PENDING)
-		list_add_tail(&req->pr_list, &dev->pr_list);
-	spin_unlock_irqrestore(&dev->queue_lock, lock_flags);
+	if (ret == TG_STATUS_PENDING) {
+		if (req->slot >= 0) {
+			dev->pool.req[req->slot] = req;
+			__set_bit(req->slot, req->q->pending);
+		} else
+			list_add_tail(&req->pr_list, &req->q->pr_list);
+	}
+	spin_unlock(&req->q->lock);
 
 out:
-	if (ret != TG_STATUS_PENDING) {
-		page_cache_release(req->pg);
-		prl_dma_unmap_page(dev->pci_dev, req->phys, PAGE_SIZE, DMA_BIDIRECTIONAL);
-	}
+	if (ret != TG_STATUS_PENDING)
+		tg_req_put_head(req);
 
 	DPRINTK("EXIT\n");
 	return ret;
 }
 
+static unsigned int *tg_poll_ewma(struct TG_PENDING_REQUEST *req)
+{
+	return &req->dev->poll.ewma_ns[hash_32(req->dst->Request,
+					       TG_POLL_HASH_BITS)];
+}
+
+/* records the service time of a completed request for its opcode */
+static void tg_poll_account(struct TG_PENDING_REQUEST *req)
+{
+	unsigned int *ewma = tg_poll_ewma(req);
+	u64 t = prl_clock_ns() - req->start_ns;
+	unsigned int old = *ewma;
+
+	if (t > UINT_MAX)
+		t = UINT_MAX;
+	*ewma = old ? old - (old >> 3) + ((unsigned int)t >> 3) : t;
+}
+
+/*
+ * Completions are not reaped by interrupt while somebody polls. The last
+ * poller runs the bottom half in case the host finished other requests.
+ */
+static void tg_poll_begin(struct tg_dev *dev)
+{
+	if (atomic_inc_return(&dev->poll.active) == 1)
+		tg_out32(dev, TG_PORT_MASK, 0);
+}
+
+static void tg_poll_end(struct tg_dev *dev)
+{
+	if (atomic_dec_and_test(&dev->poll.active)) {
+		tg_out32(dev, TG_PORT_MASK, TG_MASK_COMPLETE);
+		schedule_work(&dev->work);
+	}
+}
+
+/* returns 1 if the request completed while spinning, it is off the queue */
+static int tg_req_poll(struct TG_PENDING_REQUEST *req)
+{
+	struct tg_dev *dev = req->dev;
+	u64 budget = (u64)tg_poll_us * NSEC_PER_USEC;
+	u64 ewma, start;
+	int processed, done;
+
+	if (!budget || (req->sdesc->flags & TG_REQ_RESTART_ON_SUCCESS))
+		return 0;
+
+	ewma = *tg_poll_ewma(req);
+	if (ewma > 2 * budget) {
+		atomic_long_inc(&dev->poll.skipped);
+		return 0;
+	}
+	if (ewma)
+		budget = min(budget, 2 * ewma);
+
+	tg_poll_begin(dev);
+	start = prl_clock_ns();
+	while (!(done = (req->dst->Status != TG_STATUS_PENDING)) &&
+	       prl_clock_ns() - start < budget && !need_resched())
+		cpu_relax();
+	tg_poll_end(dev);
+
+	if (!done) {
+		atomic_long_inc(&dev->poll.misses);
+		return 0;
+	}
+	atomic_long_inc(&dev->poll.hits);
+
+	spin_lock(&req->q->lock);
+	processed = req->processed;
+	if (!processed && req->slot >= 0)
+		__clear_bit(req->slot, req->q->pending);
+	else if (!processed)
+		list_del(&req->pr_list);
+	req->processed = 1;
+	spin_unlock(&req->q->lock);
+
+	/* the bottom half got it first, it is about to wake us */
+	if (processed)
+		wait_for_completion(&req->waiting);
+	return 1;
+}
+
 static int tg_req_complete(struct TG_PENDING_REQUEST *req, int force_cancel)
 {
 	TG_PAGED_REQUEST *dst = req->dst;
 	struct tg_dev *dev = req->dev;
-	unsigned long lock_flags;
 	int ret = 0, processed;
 	DPRINTK("ENTER req:%p desc:%p src:%p dst:%p\n", req, req->sdesc, req->sdesc->src, dst);
 
 	if (force_cancel == 0) {
+		if (tg_req_poll(req))
+			goto out_account;
+
 		/* request can be handled by host, interrupted by signal
 		 * or cancelled by suspend */
 		if (req->sdesc->flags & TG_REQ_PF_CTX)
@@ -429,7 +1110,7 @@ static int tg_req_complete(struct TG_PENDING_REQUEST *req, int force_cancel)
 			ret = wait_for_completion_interruptible(&req->waiting);
 
 		if (ret >= 0)
-			goto out;
+			goto out_account;
 	}
 
 	if (dst->Status != TG_STATUS_PENDING)
@@ -441,13 +1122,15 @@ static int tg_req_complete(struct TG_PENDING_REQUEST *req, int force_cancel)
 	if (dst->Status == TG_STATUS_PENDING)
 		goto out_wait;
 
-	spin_lock_irqsave(&dev->queue_lock, lock_flags);
+	spin_lock(&req->q->lock);
 
 	processed = req->processed;
-	if (!processed)
+	if (!processed && req->slot >= 0)
+		__clear_bit(req->slot, req->q->pending);
+	else if (!processed)
 		list_del(&req->pr_list);
 
-	spin_unlock_irqrestore(&dev->queue_lock, lock_flags);
+	spin_unlock(&req->q->lock);
 
 	if (!processed)
 		/* Now we are sure that nobody will
@@ -458,9 +1141,13 @@ out_wait:
 	/* we must wait for completion, it accessed rq struct*/
 	DPRINTK("waiting for completion\n");
 	wait_for_completion(&req->waiting);
+	goto out;
+
+out_account:
+	if (tg_poll_us)
+		tg_poll_account(req);
 out:
-	page_cache_release(req->pg);
-	prl_dma_unmap_page(dev->pci_dev, req->phys, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	tg_req_put_head(req);
 	DPRINTK("EXIT\n");
 	return ret;
 }
@@ -478,15 +1165,16 @@ static void tg_req_destroy(struct TG_PENDING_REQUEST *req)
 			src->InlineByteCount, dst->InlineByteCount);
 
 	tg_req_unmap_pages(req, src->BufferCount);
+	tg_stats_complete(req);
 
-	vfree(dst);
-	vfree(req);
+	tg_req_free_dst(req);
+	kfree(req);
 
 	DPRINTK("EXIT\n");
 	return;
 }
 
-int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc)
+static int tg_pci_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc)
 {
 	struct TG_PENDING_REQUEST *req;
 	struct tg_dev *pdev = dev;
@@ -501,9 +1189,8 @@ int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc)
 	tg_req_destroy(req);
 	return 0;
 }
-EXPORT_SYMBOL(call_tg_sync);
 
-struct TG_PENDING_REQUEST *call_tg_async_start(struct tg_dev *dev, TG_REQ_DESC *sdesc)
+static struct TG_PENDING_REQUEST *tg_pci_async_start(struct tg_dev *dev, TG_REQ_DESC *sdesc)
 {
 	struct TG_PENDING_REQUEST *req;
 
@@ -517,22 +1204,122 @@ struct TG_PENDING_REQUEST *call_tg_async_start(struct tg_dev *dev, TG_REQ_DESC *
 	tg_req_destroy(req);
 	return NULL;
 }
-EXPORT_SYMBOL(call_tg_async_start);
 
-void call_tg_async_wait(struct TG_PENDING_REQUEST *req)
+static void tg_pci_async_wait(struct TG_PENDING_REQUEST *req)
 {
-	if (req) {
-		tg_req_complete(req, 0);
+	tg_req_complete(req, 0);
+	tg_req_destroy(req);
+}
+
+static void tg_pci_async_cancel(struct TG_PENDING_REQUEST *req)
+{
+	tg_req_complete(req, 1);
+	tg_req_destroy(req);
+}
+
+/* finishes a request submitted with a callback, req is freed on return */
+void tg_req_end_io(struct TG_PENDING_REQUEST *req)
+{
+	void (*end_io)(TG_REQ_DESC *, void *) = req->end_io;
+	TG_REQ_DESC *sdesc = req->sdesc;
+	void *data = req->end_io_data;
+
+	tg_req_put_head(req);
+	tg_req_destroy(req);
+	end_io(sdesc, data);
+}
+
+static int tg_pci_async_submit(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+			       tg_end_io_t end_io, void *data)
+{
+	struct TG_PENDING_REQUEST *req;
+
+	req = tg_req_create(dev, sdesc);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->end_io = end_io;
+	req->end_io_data = data;
+	/* once queued the request may complete and be freed at any moment */
+	if (tg_req_submit(req) != TG_STATUS_PENDING) {
 		tg_req_destroy(req);
+		end_io(sdesc, data);
+	}
+	return 0;
+}
+
+static int tg_pci_probe(struct tg_dev *dev)
+{
+	return dev->base_addr ? 0 : -ENODEV;
+}
+
+static const struct tg_transport tg_pci_transport = {
+	.name		= "pci",
+	.probe		= tg_pci_probe,
+	.sync		= tg_pci_sync,
+	.async_start	= tg_pci_async_start,
+	.async_wait	= tg_pci_async_wait,
+	.async_cancel	= tg_pci_async_cancel,
+	.async_submit	= tg_pci_async_submit,
+};
+
+/*
+ * In order of preference, the first one whose probe succeeds carries all
+ * requests of the device. The PCI toolgate is what the host implements so
+ * far and is used when nothing else is available.
+ */
+static const struct tg_transport *tg_transports[] = {
+	&tg_pci_transport,
+};
+
+void tg_transport_select(struct tg_dev *dev)
+{
+	unsigned int i;
+
+	dev->transport = &tg_pci_transport;
+	for (i = 0; i < ARRAY_SIZE(tg_transports); i++) {
+		if (!tg_transports[i]->probe(dev)) {
+			dev->transport = tg_transports[i];
+			break;
+		}
 	}
+	DPRINTK("using %s transport\n", dev->transport->name);
+}
+
+int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc)
+{
+	return dev->transport->sync(dev, sdesc);
+}
+EXPORT_SYMBOL(call_tg_sync);
+
+struct TG_PENDING_REQUEST *call_tg_async_start(struct tg_dev *dev, TG_REQ_DESC *sdesc)
+{
+	return dev->transport->async_start(dev, sdesc);
+}
+EXPORT_SYMBOL(call_tg_async_start);
+
+void call_tg_async_wait(struct TG_PENDING_REQUEST *req)
+{
+	if (req)
+		req->dev->transport->async_wait(req);
 }
 EXPORT_SYMBOL(call_tg_async_wait);
 
 void call_tg_async_cancel(struct TG_PENDING_REQUEST *req)
 {
-	if (req) {
-		tg_req_complete(req, 1);
-		tg_req_destroy(req);
-	}
+	if (req)
+		req->dev->transport->async_cancel(req);
 }
 EXPORT_SYMBOL(call_tg_async_cancel);
+
+/*
+ * Submits a request without waiting for it. end_io is called exactly once
+ * when the host is done with it, directly if that happens before return.
+ * Returns -ENOMEM and does not call end_io if the request can't be built.
+ */
+int call_tg_async_submit(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+			 tg_end_io_t end_io, void *data)
+{
+	return dev->transport->async_submit(dev, sdesc, end_io, data);
+}
+EXPORT_SYMBOL(call_tg_async_submit);
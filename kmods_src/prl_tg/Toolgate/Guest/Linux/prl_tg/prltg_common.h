@@ -8,6 +8,7 @@
 #include <linux/version.h>
 #include <linux/pm.h>
 #include <linux/compat.h>
+#include <linux/scatterlist.h>
 #include <video/vga.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
@@ -74,19 +75,135 @@ typedef enum {
 #define TG_DEV_FLAG_MSI		(1 << 0)
 #define TG_DEV_FLAG_OUTS	(1 << 1)
 
+#define TG_POOL_SLOTS		64
+
+/*
+ * Longest DMA segment, what swiotlb bounces at once (IO_TLB_SEGSIZE <<
+ * IO_TLB_SHIFT). dma_max_mapping_size() would tell, but it is GPL only.
+ */
+#define TG_DMA_SEG_MAX		(256 * 1024)
+
+/*
+ * Page sized request descriptors allocated DMA coherent once per device,
+ * so that small requests need neither vmalloc nor a streaming mapping.
+ */
+struct tg_req_pool {
+	unsigned int nr;
+	void *va[TG_POOL_SLOTS];
+	dma_addr_t dma[TG_POOL_SLOTS];
+	unsigned long used[BITS_TO_LONGS(TG_POOL_SLOTS)];
+	struct TG_PENDING_REQUEST *req[TG_POOL_SLOTS];
+	atomic_t inuse;
+	atomic_t peak;
+	atomic_long_t hits;		/* served from the pool */
+	atomic_long_t exhausted;	/* fell back, all slots busy */
+	atomic_long_t oversize;		/* fell back, larger than a page */
+};
+
+#define TG_POLL_HASH_BITS	6
+
+/*
+ * Hybrid completion: a waiter spins on the request status for up to
+ * tg_poll_us, bounded by the service time seen for the opcode.
+ */
+struct tg_poll {
+	unsigned int ewma_ns[1 << TG_POLL_HASH_BITS];
+	atomic_t active;		/* pollers, interrupt is masked meanwhile */
+	atomic_long_t hits;		/* completed while polling */
+	atomic_long_t misses;		/* polled, then slept */
+	atomic_long_t skipped;		/* opcode usually slower than the budget */
+};
+
+extern unsigned int tg_poll_us;
+
+/* tg_req_cancel_all() waits for all cancelled requests at once */
+struct tg_cancel {
+	atomic_t active;		/* the interrupt wakes wait meanwhile */
+	wait_queue_head_t wait;
+	unsigned int runs;
+	unsigned int last_nr;		/* requests cancelled by the last run */
+	unsigned int last_ms;
+	unsigned int max_ms;
+	unsigned int leaked;		/* never confirmed by the host */
+};
+
+#define TG_STATS_OP_BITS	5
+#define TG_STATS_OPS		(1 << TG_STATS_OP_BITS)
+#define TG_STATS_STATUSES	32
+#define TG_STATS_LAT		20
+
+/* latency is counted in log2 buckets of microseconds */
+struct tg_op_stats {
+	atomic64_t submits;
+	atomic64_t completions;
+	atomic64_t errors;
+	atomic64_t bytes;
+	atomic64_t lat[TG_STATS_LAT];
+};
+
+/*
+ * Per opcode request statistics, opcodes take a slot of ops[] on first use.
+ * Counters are atomics of the device, alloc_percpu() is GPL only.
+ */
+struct tg_stats {
+	u32 ops[TG_STATS_OPS];
+	/* the extra slot counts opcodes that found ops[] full */
+	struct tg_op_stats op[TG_STATS_OPS + 1];
+	/* failures by TG_STATUS_* - TG_STATUS_CANCELLED, the last is the rest */
+	atomic64_t status[TG_STATS_STATUSES];
+};
+
+#define TG_MAX_QUEUES		8
+
+/*
+ * Submitted requests are spread over several queues by the submitting CPU,
+ * so that CPUs don't contend for one lock. A queue owns a range of pool
+ * slots, pooled requests go to the queue of their slot.
+ */
+struct tg_queue {
+	spinlock_t lock;	/* protects the queue, not taken in irq */
+	struct list_head pr_list; /* pending requests not in the pool */
+	/* submitted and not yet completed slots of this queue */
+	unsigned long pending[BITS_TO_LONGS(TG_POOL_SLOTS)];
+} ____cacheline_aligned_in_smp;
+
+struct tg_dev;
+struct TG_PENDING_REQUEST;
+
+/* how requests reach the host, entries of call_tg_*() */
+struct tg_transport {
+	const char *name;
+	int (*probe)(struct tg_dev *dev);	/* 0 if the host supports it */
+	int (*sync)(struct tg_dev *dev, TG_REQ_DESC *sdesc);
+	struct TG_PENDING_REQUEST *(*async_start)(struct tg_dev *dev, TG_REQ_DESC *sdesc);
+	void (*async_wait)(struct TG_PENDING_REQUEST *req);
+	void (*async_cancel)(struct TG_PENDING_REQUEST *req);
+	int (*async_submit)(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+			    void (*end_io)(TG_REQ_DESC *, void *), void *data);
+};
+
 struct tg_dev {
 	board_t board;
+	const struct tg_transport *transport;
 	unsigned int irq;
 	void __iomem *base_addr;
-	spinlock_t queue_lock; /* protects queue of submitted requests */
-	struct list_head pr_list; /* pending requests list */
+	unsigned int nr_queues;
+	unsigned int queue_slots; /* pool slots per queue */
+	struct tg_queue queues[TG_MAX_QUEUES];
 	struct work_struct work;
 	struct pci_dev *pci_dev;
-	spinlock_t lock;	/* protects device's port IO operations */
+	spinlock_t lock;	/* serializes split 64-bit port writes */
 	unsigned int flags;
 #ifdef PRLVTG_MMAP
 	unsigned int capabilities;
 	resource_size_t mem_phys, mem_size;
+#endif
+	struct tg_req_pool pool;
+	struct tg_poll poll;
+	struct tg_cancel cancel;
+	struct tg_stats stats;
+#ifdef PRLTG_BENCH
+	struct tg_bench *bench;
 #endif
 };
 
@@ -99,10 +216,17 @@ struct TG_PENDING_REQUEST
 	struct list_head pr_list;
 	struct list_head up_list;
 
+	struct tg_queue *q;			/* Queue the request is pending on */
 	struct completion waiting;
-	int processed;				/* Protected by queue_lock */
+	int processed;				/* Protected by q->lock */
 	dma_addr_t phys;			/* Physical address of first page of request */
+	u64 start_ns;				/* Submit time */
 	struct page *pg;			/* First page of request descriptor */
+	int slot;				/* Pool slot of dst, -1 if vmalloced */
+	struct up_list_entry *dmap;		/* Pages of a vmalloced dst */
+	unsigned int ubuf_mask;			/* Buffers mapped by registration */
+	void (*end_io)(TG_REQ_DESC *, void *);	/* Called instead of waking a waiter */
+	void *end_io_data;
 };
 
 /*
@@ -116,9 +240,39 @@ struct up_list_entry {
 	int count;
 	/* user pages must be marked dirty if device touched them */
 	unsigned writable;
+	/* registered buffer the pages belong to, p is not used then */
+	struct tg_ubuf *ub;
+	/* contiguous runs of p as mapped for the device */
+	struct sg_table sgt;
 	struct page *p[0];
 };
 
+/*
+ * User buffer pinned and DMA mapped once for many requests. The
+ * registration and every request using the buffer hold a reference.
+ */
+struct tg_ubuf {
+	struct list_head list;
+	struct tg_dev *dev;
+	unsigned long va;
+	unsigned int len;
+	unsigned int id;
+	unsigned int npages;
+	unsigned int writable;
+	atomic_t users;
+	struct page **pages;
+	dma_addr_t *dma;
+	struct mm_struct *mm;		/* va is of this address space, a key only */
+	struct user_struct *user;	/* charged for the pages, if not NULL */
+};
+
+struct tg_ubuf_set {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned int nr;
+	unsigned int next_id;
+};
+
 struct vtg_filp_private {
 	struct list_head	hash_list;
 	struct list_head	glctx_list;
@@ -140,48 +294,46 @@ enum TgRegisters {
 	TG_MAX_MEM	= 0x1000,
 };
 
-/* Port IO primitives */
+/*
+ * Port IO primitives. Single accesses need no locking, only a 64-bit value
+ * written as two dwords must not interleave with another CPU's write.
+ */
 static __inline u32
 tg_in32(struct tg_dev *dev, unsigned long port)
 {
 	u32 x;
-	unsigned long flags;
 
-	spin_lock_irqsave(&dev->lock, flags);
 #if defined(__aarch64__)
 	x = ioread32(dev->base_addr + port);
 #else
 	x = inl(dev->base_addr + port);
 #endif
-	spin_unlock_irqrestore(&dev->lock, flags);
 	return (x);
 }
 
 static __inline void
 tg_out32(struct tg_dev *dev, unsigned long port, u32 val)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&dev->lock, flags);
 #if defined(__aarch64__)
 	iowrite32(val, dev->base_addr + port);
 #else
 	outl(val, dev->base_addr + port);
 #endif
-	spin_unlock_irqrestore(&dev->lock, flags);
 }
 
 static __inline void
 tg_out(struct tg_dev *dev, unsigned long port, unsigned long long val)
 {
+#if !defined(__aarch64__)
 	unsigned long flags;
+#endif
 
 	port += dev->base_addr;
-	spin_lock_irqsave(&dev->lock, flags);
 
 #if defined(__aarch64__)
 	iowrite64(val, port);
 #else
+	spin_lock_irqsave(&dev->lock, flags);
 	if (dev->flags & TG_DEV_FLAG_OUTS) {
 		unsigned long len = (sizeof(unsigned long long) >> 2);
 		void *ptr = &val;
@@ -200,8 +352,21 @@ tg_out(struct tg_dev *dev, unsigned long port, unsigned long long val)
 
 		outl(val_l, port);
 	}
-#endif // __aarch64__
 	spin_unlock_irqrestore(&dev->lock, flags);
+#endif // __aarch64__
+}
+
+/* queue for requests submitted from this CPU */
+static __inline struct tg_queue *
+tg_queue_local(struct tg_dev *dev)
+{
+	return &dev->queues[raw_smp_processor_id() % dev->nr_queues];
+}
+
+static __inline struct tg_queue *
+tg_queue_of_slot(struct tg_dev *dev, int slot)
+{
+	return &dev->queues[slot / dev->queue_slots];
 }
 
 struct pci_dev;
@@ -215,6 +380,37 @@ int prl_tg_suspend_common(struct tg_dev *dev, pm_message_t state);
 int prl_tg_resume_common(struct tg_dev *dev);
 #endif
 
+int tg_pool_init(struct tg_dev *dev);
+void tg_pool_destroy(struct tg_dev *dev);
+void tg_queues_init(struct tg_dev *dev);
+void tg_queues_split(struct tg_dev *dev);
+void tg_req_end_io(struct TG_PENDING_REQUEST *req);
+void tg_transport_select(struct tg_dev *dev);
+
+struct seq_file;
+void tg_stats_init(struct tg_dev *dev);
+void tg_stats_show(struct seq_file *m, struct tg_dev *dev);
+void tg_stats_reset(struct tg_dev *dev);
+
+struct proc_dir_entry;
+struct proc_dir_entry *
+prltg_proc_create_data(char *name, umode_t mode, struct proc_dir_entry *parent,
+                       struct proc_ops *proc_ops, void *data);
+
+#ifdef PRLTG_BENCH
+int tg_bench_init(struct tg_dev *dev);
+void tg_bench_destroy(struct tg_dev *dev);
+#else
+static inline int tg_bench_init(struct tg_dev *dev) { return 0; }
+static inline void tg_bench_destroy(struct tg_dev *dev) {}
+#endif
+
+void tg_ubuf_set_init(struct tg_ubuf_set *set);
+void tg_ubuf_set_destroy(struct tg_ubuf_set *set);
+int tg_ubuf_register(struct tg_dev *dev, struct tg_ubuf_set *set,
+		     unsigned long va, unsigned int len, int writable);
+int tg_ubuf_unregister(struct tg_ubuf_set *set, unsigned int id);
+
 int prl_tg_user_to_host_request_prepare(void *ureq, TG_REQ_DESC *sdesc, TG_REQUEST *src);
 int prl_tg_user_to_host_request_complete(char *u, TG_REQ_DESC *sdesc, int ret);
 
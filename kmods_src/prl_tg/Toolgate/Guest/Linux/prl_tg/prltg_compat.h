@@ -8,6 +8,8 @@
 #include <linux/version.h>
 #include <linux/proc_fs.h>
 #include <linux/fs.h>
+#include <linux/time.h>
+#include <linux/ktime.h>
 
 #ifndef DEFINE_SPINLOCK
 #define DEFINE_SPINLOCK(x) spinlock_t x = SPIN_LOCK_UNLOCKED
@@ -37,6 +39,27 @@
 #define PDE_DATA(x) (PDE(x)->data)
 #endif
 
+/* monotonic ns for timing, ktime_get() and local_clock() are GPL only */
+static inline u64 prl_clock_ns(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	struct timespec64 ts;
+
+	ktime_get_raw_ts64(&ts);
+	return timespec64_to_ns(&ts);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 17, 0)
+	struct timespec64 ts;
+
+	getrawmonotonic64(&ts);
+	return timespec64_to_ns(&ts);
+#else
+	struct timespec ts;
+
+	getrawmonotonic(&ts);
+	return timespec_to_ns(&ts);
+#endif
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
 #define PROC_OWNER(p, own)	p->owner = own
 #else
@@ -76,6 +99,23 @@
 #endif
 
 
+/*
+ * Registered buffers are pinned long term and charged to the locked_vm
+ * of the user against RLIMIT_MEMLOCK, as io_uring does. Without that
+ * only CAP_IPC_LOCK may register.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && defined(CONFIG_NET)
+#define PRLTG_UBUF_PIN
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define prl_pin_user_pages(_1, _2, _3, _4) \
+		pin_user_pages(_1, _2, FOLL_LONGTERM | ((_3) ? FOLL_WRITE : 0), _4)
+#else
+#define prl_pin_user_pages(_1, _2, _3, _4) \
+		pin_user_pages(_1, _2, FOLL_LONGTERM | ((_3) ? FOLL_WRITE : 0), \
+			       _4, NULL)
+#endif
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
 
 #define PRLTG_PROC_OPS_INIT(_open, _write, _unlocked_ioctl, _mmap, _release) \
@@ -102,6 +142,77 @@
 
 #endif
 
+/* entries with a read side and poll() in addition to write() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+
+#define PRLTG_PROC_OPS_RW_INIT(_open, _read, _write, _poll, _unlocked_ioctl, _release) \
+	{ \
+		.proc_open = _open, \
+		.proc_read = _read, \
+		.proc_write = _write, \
+		.proc_poll = _poll, \
+		.proc_ioctl = _unlocked_ioctl, \
+		PRLTG_PROC_COMPAT_IOCTL(.proc_compat_ioctl, _unlocked_ioctl) \
+		.proc_release = _release, \
+	}
+
+#else
+
+#define PRLTG_PROC_OPS_RW_INIT(_open, _read, _write, _poll, _unlocked_ioctl, _release) \
+	{ \
+		.open = _open, \
+		.read = _read, \
+		.write = _write, \
+		.poll = _poll, \
+		.unlocked_ioctl = _unlocked_ioctl, \
+		PRLTG_PROC_COMPAT_IOCTL(.compat_ioctl, _unlocked_ioctl) \
+		.release = _release, \
+	}
+
+#endif
+
+/* ioctl structures have the same layout for 32-bit callers */
+#ifdef CONFIG_COMPAT
+#define PRLTG_PROC_COMPAT_IOCTL(_field, _ioctl) _field = _ioctl,
+#else
+#define PRLTG_PROC_COMPAT_IOCTL(_field, _ioctl)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define PRLTG_POLLIN (EPOLLIN | EPOLLRDNORM)
+#else
+typedef unsigned int __poll_t;
+#define PRLTG_POLLIN (POLLIN | POLLRDNORM)
+#endif
+
+/* seq_file entries opened with single_open() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define PRLTG_PROC_SEQ_OPS_INIT(_open, _write) \
+	{ \
+		.proc_open = _open, \
+		.proc_read = seq_read, \
+		.proc_write = _write, \
+		.proc_lseek = seq_lseek, \
+		.proc_release = single_release, \
+	}
+#else
+#define PRLTG_PROC_SEQ_OPS_INIT(_open, _write) \
+	{ \
+		.owner = THIS_MODULE, \
+		.open = _open, \
+		.read = seq_read, \
+		.write = _write, \
+		.llseek = seq_lseek, \
+		.release = single_release, \
+	}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define prl_pde_data(inode) pde_data(inode)
+#else
+#define prl_pde_data(inode) PDE_DATA(inode)
+#endif
+
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
 #define prl_mmap_read_lock(mm) mmap_read_lock(mm)
@@ -127,4 +238,9 @@
 #define prl_dma_unmap_page(__dev, __dma_addr, __size, __direction) pci_unmap_page(&((__dev)->dev), (__dma_addr), (__size), (__direction))
 #endif
 
+#define prl_dma_map_sg(__dev, __sg, __nents, __direction) dma_map_sg(&((__dev)->dev), (__sg), (__nents), (__direction))
+#define prl_dma_unmap_sg(__dev, __sg, __nents, __direction) dma_unmap_sg(&((__dev)->dev), (__sg), (__nents), (__direction))
+#define prl_dma_sync_for_cpu(__dev, __dma_addr, __size, __direction) dma_sync_single_for_cpu(&((__dev)->dev), (__dma_addr), (__size), (__direction))
+#define prl_dma_sync_for_device(__dev, __dma_addr, __size, __direction) dma_sync_single_for_device(&((__dev)->dev), (__dma_addr), (__size), (__direction))
+
 #endif /* __PRL_TG_COMPAT_H__ */
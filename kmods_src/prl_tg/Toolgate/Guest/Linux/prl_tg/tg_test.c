@@ -1,19 +1,70 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/types.h>
 
 #include "../Interfaces/prltg.h"
 #include "../../Interfaces/tgreq.h"
 
-int
-main(int argc, char *argv[])
+/*
+ * Without arguments sends one TG_REQUEST_UT_COMMAND request as a smoke
+ * test. With options measures round trips of user space requests over the
+ * cross product of the given inline sizes, buffer counts, buffer sizes and
+ * thread counts, or of the in-kernel TG_REQUEST_FS_NOOP requests of a
+ * driver built with PRLTG_BENCH=1. Every run prints one line of key=value
+ * pairs.
+ */
+
+#define TG_BENCH_FILE	PRL_TG_FILE "_bench"
+#define MAX_LIST	16
+#define MAX_BUFFERS	TG_UBUF_MAX
+#define MAX_BUF_SIZE	TG_UBUF_MAX_LEN
+
+struct list {
+	unsigned long long v[MAX_LIST];
+	int nr;
+};
+
+struct config {
+	unsigned int op;
+	unsigned int inline_bytes;
+	unsigned int buffers;
+	unsigned long long size;
+	unsigned int threads;
+	unsigned int requests;		/* per thread */
+	unsigned long long max_ns;	/* per run */
+	int reg;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct config *cfg;
+	pthread_barrier_t *start;
+	unsigned long long *lat;
+	unsigned int done;
+	unsigned int errors;
+	int err;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int smoke_test(void)
 {
-	int fd, ret;
+	int fd;
 	char buf0[32];
 	struct {
 		TG_REQUEST req;
@@ -52,3 +103,357 @@ main(int argc, char *argv[])
 	}
 	return 0;
 }
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	const struct config *cfg = w->cfg;
+	size_t isize = (cfg->inline_bytes + 7) & ~7;
+	TG_REQUEST *req;
+	TG_BUFFER *tgb;
+	char *bufs[MAX_BUFFERS] = { NULL };
+	unsigned long long start, deadline;
+	unsigned int i;
+	int fd;
+
+	fd = open(PRL_TG_FILE, O_RDWR);
+	if (fd < 0) {
+		w->err = errno;
+		pthread_barrier_wait(w->start);
+		return NULL;
+	}
+	req = calloc(1, sizeof(*req) + isize + cfg->buffers * sizeof(*tgb));
+	if (!req)
+		w->err = ENOMEM;
+	tgb = (TG_BUFFER *)((char *)(req + 1) + isize);
+	for (i = 0; !w->err && i < cfg->buffers; i++) {
+		if (posix_memalign((void **)&bufs[i], 4096, cfg->size)) {
+			w->err = ENOMEM;
+			break;
+		}
+		/* have the pages allocated before the clock starts */
+		memset(bufs[i], 0, cfg->size);
+		tgb[i].u.Va = (unsigned long)bufs[i];
+		tgb[i].ByteCount = cfg->size;
+		tgb[i].Writable = TG_BUFFER_READWRITE;
+		if (cfg->reg) {
+			struct tg_ubuf_reg r = {
+				.va = (unsigned long)bufs[i],
+				.len = cfg->size,
+				.writable = 1,
+			};
+			if (ioctl(fd, TG_IOCTL_REGISTER, &r) < 0)
+				w->err = errno;
+		}
+	}
+	pthread_barrier_wait(w->start);
+
+	deadline = now_ns() + cfg->max_ns;
+	for (i = 0; !w->err && i < cfg->requests; i++) {
+		void *p = req;
+
+		req->Request = cfg->op;
+		req->Status = 0;
+		req->InlineByteCount = cfg->inline_bytes;
+		req->BufferCount = cfg->buffers;
+		start = now_ns();
+		if (write(fd, &p, sizeof(p)) < 0 || req->Status != 0)
+			w->errors++;
+		w->lat[i] = now_ns() - start;
+		w->done++;
+		if (w->lat[i] + start > deadline)
+			break;
+	}
+
+	for (i = 0; i < cfg->buffers; i++)
+		free(bufs[i]);
+	free(req);
+	close(fd);
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run_user(const struct config *cfg)
+{
+	static const unsigned int pct[] = { 500, 900, 990, 999, 1000 };
+	unsigned long long lat[5], *all, start, ns, bytes;
+	struct worker *w;
+	pthread_barrier_t barrier;
+	unsigned int i, nr = 0, errors = 0;
+	int err = 0;
+
+	w = calloc(cfg->threads, sizeof(*w));
+	all = calloc((size_t)cfg->threads * cfg->requests, sizeof(*all));
+	if (!w || !all) {
+		fprintf(stderr, "no memory\n");
+		return -1;
+	}
+
+	pthread_barrier_init(&barrier, NULL, cfg->threads + 1);
+	for (i = 0; i < cfg->threads; i++) {
+		w[i].cfg = cfg;
+		w[i].start = &barrier;
+		w[i].lat = all + (size_t)i * cfg->requests;
+		if (pthread_create(&w[i].thread, NULL, worker_run, &w[i])) {
+			fprintf(stderr, "cannot create threads\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (i = 0; i < cfg->threads; i++)
+		pthread_join(w[i].thread, NULL);
+	ns = now_ns() - start;
+	pthread_barrier_destroy(&barrier);
+
+	for (i = 0; i < cfg->threads; i++) {
+		if (w[i].err)
+			err = w[i].err;
+		/* compact the samples for sorting */
+		memmove(all + nr, w[i].lat, w[i].done * sizeof(*all));
+		nr += w[i].done;
+		errors += w[i].errors;
+	}
+	if (err || !nr) {
+		fprintf(stderr, "inline=%u buffers=%u size=%llu threads=%u: %s\n",
+			cfg->inline_bytes, cfg->buffers, cfg->size,
+			cfg->threads, strerror(err ? err : EIO));
+		free(all);
+		free(w);
+		return -1;
+	}
+
+	qsort(all, nr, sizeof(*all), cmp_ull);
+	for (i = 0; i < 5; i++)
+		lat[i] = all[(unsigned long long)(nr - 1) * pct[i] / 1000];
+	bytes = (unsigned long long)nr * cfg->buffers * cfg->size;
+	printf("mode=user op=0x%x inline=%u buffers=%u size=%llu threads=%u "
+	       "registered=%d requests=%u errors=%u ns=%llu ops_per_s=%llu "
+	       "bytes_per_s=%llu p50_ns=%llu p90_ns=%llu p99_ns=%llu "
+	       "p999_ns=%llu max_ns=%llu\n",
+	       cfg->op, cfg->inline_bytes, cfg->buffers, cfg->size,
+	       cfg->threads, cfg->reg, nr, errors, ns,
+	       nr * 1000000000ULL / (ns ? ns : 1),
+	       (unsigned long long)(bytes * 1e9 / (ns ? ns : 1)),
+	       lat[0], lat[1], lat[2], lat[3], lat[4]);
+	fflush(stdout);
+	free(all);
+	free(w);
+	return 0;
+}
+
+/* the driver runs the requests from our write, then reports them */
+static int run_kernel(const char *mode, unsigned int requests,
+		      unsigned int depth)
+{
+	char line[512];
+	FILE *f;
+	int fd, len;
+
+	fd = open(TG_BENCH_FILE, O_WRONLY);
+	if (fd < 0) {
+		perror("opening " TG_BENCH_FILE);
+		return -1;
+	}
+	len = snprintf(line, sizeof(line), "%s %u %u", mode, requests, depth);
+	if (write(fd, line, len) < 0) {
+		perror("running in-kernel benchmark");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	f = fopen(TG_BENCH_FILE, "r");
+	if (!f) {
+		perror("opening " TG_BENCH_FILE);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f))
+		fputs(line, stdout);
+	fclose(f);
+	return 0;
+}
+
+static int parse_list(struct list *l, char *s)
+{
+	char *tok, *end;
+
+	l->nr = 0;
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		unsigned long long v = strtoull(tok, &end, 0);
+
+		if (*end == 'k' || *end == 'K')
+			v <<= 10, end++;
+		else if (*end == 'm' || *end == 'M')
+			v <<= 20, end++;
+		if (*end || end == tok || l->nr == MAX_LIST)
+			return -1;
+		l->v[l->nr++] = v;
+	}
+	return l->nr ? 0 : -1;
+}
+
+static void set_list(struct list *l, const unsigned long long *v, int nr)
+{
+	memcpy(l->v, v, nr * sizeof(*v));
+	l->nr = nr;
+}
+
+static int run_lists(struct config *cfg, const struct list *inl,
+		     const struct list *bufs, const struct list *sizes,
+		     const struct list *threads)
+{
+	int a, b, c, d, ret = 0;
+
+	for (a = 0; a < inl->nr; a++)
+	for (b = 0; b < bufs->nr; b++)
+	for (c = 0; c < sizes->nr; c++)
+	for (d = 0; d < threads->nr; d++) {
+		cfg->inline_bytes = inl->v[a];
+		cfg->buffers = bufs->v[b];
+		cfg->size = sizes->v[c];
+		cfg->threads = threads->v[d];
+		if (cfg->inline_bytes > 0xffff || cfg->buffers > MAX_BUFFERS ||
+		    !cfg->size || cfg->size > MAX_BUF_SIZE || !cfg->threads) {
+			fprintf(stderr, "inline up to 65535, buffers up to %d, "
+				"size up to %d, threads from 1\n",
+				MAX_BUFFERS, MAX_BUF_SIZE);
+			return -1;
+		}
+		if (run_user(cfg))
+			ret = -1;
+	}
+	return ret;
+}
+
+/* varies one parameter at a time around 0 inline, 1 buffer of 4k, 1 thread */
+static int run_sweep(struct config *cfg)
+{
+	static const unsigned long long one[] = { 1 }, zero[] = { 0 },
+		page[] = { 4096 },
+		inl[] = { 0, 64, 512, 4096, 32768 },
+		bufs[] = { 1, 2, 4, 8, 16 },
+		sizes[] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 64 << 20 },
+		threads[] = { 1, 2, 4, 8, 16 };
+	struct list l[4];
+	int ret = 0;
+
+	set_list(&l[0], inl, 5);
+	set_list(&l[1], one, 1);
+	set_list(&l[2], page, 1);
+	set_list(&l[3], one, 1);
+	ret |= run_lists(cfg, &l[0], &l[1], &l[2], &l[3]);
+	set_list(&l[0], zero, 1);
+	set_list(&l[1], bufs, 5);
+	ret |= run_lists(cfg, &l[0], &l[1], &l[2], &l[3]);
+	set_list(&l[1], one, 1);
+	set_list(&l[2], sizes, 5);
+	ret |= run_lists(cfg, &l[0], &l[1], &l[2], &l[3]);
+	set_list(&l[2], page, 1);
+	set_list(&l[3], threads, 5);
+	ret |= run_lists(cfg, &l[0], &l[1], &l[2], &l[3]);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s                 send one request as a smoke test\n"
+		"       %s [options]       benchmark user space requests\n"
+		"  -o OP      request opcode, default 0x8000\n"
+		"  -i LIST    inline sizes, default 0\n"
+		"  -b LIST    buffer counts, default 1\n"
+		"  -s LIST    buffer sizes, k and m suffixes, default 4k\n"
+		"  -t LIST    thread counts, default 1\n"
+		"  -n N       requests per thread and run, default 10000\n"
+		"  -T MS      time limit of a run, default 2000\n"
+		"  -R         register buffers with the driver first\n"
+		"  -S         sweep each parameter separately\n"
+		"  -k MODE    sync or async in-kernel FS_NOOP requests\n"
+		"  -d DEPTH   requests in flight for -k async, default 16\n"
+		"LIST is comma separated, all combinations are run\n",
+		name, name);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned long long zero[] = { 0 }, one[] = { 1 },
+		page[] = { 4096 };
+	struct config cfg = {
+		.op = 0x8000,
+		.requests = 10000,
+		.max_ns = 2000000000ULL,
+	};
+	struct list inl, bufs, sizes, threads;
+	const char *kmode = NULL;
+	unsigned int depth = 16;
+	int opt, sweep = 0;
+
+	if (argc == 1)
+		return smoke_test();
+
+	set_list(&inl, zero, 1);
+	set_list(&bufs, one, 1);
+	set_list(&sizes, page, 1);
+	set_list(&threads, one, 1);
+	while ((opt = getopt(argc, argv, "o:i:b:s:t:n:T:RSk:d:")) != -1) {
+		switch (opt) {
+		case 'o':
+			cfg.op = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			if (parse_list(&inl, optarg))
+				usage(argv[0]);
+			break;
+		case 'b':
+			if (parse_list(&bufs, optarg))
+				usage(argv[0]);
+			break;
+		case 's':
+			if (parse_list(&sizes, optarg))
+				usage(argv[0]);
+			break;
+		case 't':
+			if (parse_list(&threads, optarg))
+				usage(argv[0]);
+			break;
+		case 'n':
+			cfg.requests = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.max_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'R':
+			cfg.reg = 1;
+			break;
+		case 'S':
+			sweep = 1;
+			break;
+		case 'k':
+			kmode = optarg;
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !cfg.requests)
+		usage(argv[0]);
+
+	if (kmode)
+		return run_kernel(kmode, cfg.requests, depth) ? 1 : 0;
+	if (sweep)
+		return run_sweep(&cfg) ? 1 : 0;
+	return run_lists(&cfg, &inl, &bufs, &sizes, &threads) ? 1 : 0;
+}